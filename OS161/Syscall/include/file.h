@@ -12,23 +12,68 @@
 #include <types.h>
 #include <thread.h>
 
+struct iovec;
+struct pollfd;
+struct __fd_set;
+struct timeval;
+struct aio_ring;
+
 /*
  * Put your function declarations and data types here ...
  */
-/* File Descriptor Structure */
-struct fdesc{
-	char file_name[__NAME_MAX];
-	struct vnode *vn; //   - Reference to the underlying file 'object'
-	off_t offset;     //      - Offset into the file
-	struct lock *lk;   //- Some form of synchronization
-	int flags;      // - Flags with which the file was opened
-	int refcount; //- Reference count
+/*
+ * read/write move at most FILE_IOCHUNK bytes per VOP call, and at most
+ * FILE_IOMAX bytes in all so that the count fits in the return value.
+ */
+#define FILE_IOCHUNK (64 * 1024)
+#define FILE_IOMAX   0x7fffffff
+
+/* readv/writev keep iovec arrays up to this long on the stack */
+#define FILE_IOVSTACK 8
+
+/* Descriptors refer to shared, refcounted open files; see openfile.h */
+struct openfile;
+
+/*
+ * Per-thread descriptor table, grown on demand from FDTABLE_MIN to
+ * FDTABLE_MAX slots. fdt_inuse is a bitmap of the open descriptors and
+ * fdt_full has a bit set for each word of it that is all ones; see
+ * fdtable_place. Each open slot holds one reference to its openfile;
+ * fdtable_destroy drops them and fdtable_copy (for fork) takes more.
+ */
+#define FDTABLE_MIN OPEN_MAX
+#define FDTABLE_MAX 1024
+
+struct fdtable {
+	struct openfile **fdt_files;
+	uint32_t *fdt_inuse;
+	uint32_t fdt_full;
+	unsigned fdt_size;
 };
 
+struct fdtable *fdtable_create(void);
+void fdtable_destroy(struct fdtable *ft);
+int fdtable_copy(struct fdtable *src, struct fdtable **dest_ret);
+int fdtable_place(struct fdtable *ft, struct openfile *file, int *fd);
+int fdtable_placeat(struct fdtable *ft, struct openfile *file, int fd);
+struct openfile *fdtable_remove(struct fdtable *ft, int fd);
+struct openfile *fdtable_get(struct fdtable *ft, int fd);
+
 int sys_open(const char *filename, int flags,mode_t mode, int *retval);
 int sys_close(int filehandle, int *retval);
 int sys_write(int filehandle, const void *buf, size_t size, int *retval);
 int sys_read(int filehandle, void *buf, size_t size, int *retval);
+int sys_pread(int filehandle, void *buf, size_t size, off_t pos, int *retval);
+int sys_pwrite(int filehandle, const void *buf, size_t size, off_t pos, int *retval);
+int sys_readv(int filehandle, const struct iovec *iov, int iovcnt, int *retval);
+int sys_writev(int filehandle, const struct iovec *iov, int iovcnt, int *retval);
+int sys_pipe(int *fds, int *retval);
+int sys_poll(struct pollfd *fds, unsigned nfds, int timeout, int *retval);
+int sys_select(int nfds, struct __fd_set *readfds, struct __fd_set *writefds,
+               struct __fd_set *exceptfds, struct timeval *timeout,
+               int *retval);
+int sys_aio_setup(struct aio_ring *ring, int *retval);
+int sys_aio_enter(int fd, unsigned min_complete, int *retval);
 int sys_lseek(int filehandle, off_t pos, int whence, int *retval, int *retval1);
 int filetable_init(struct thread*);
 int sys_dup2(int fd, int new_fd, int* retval);
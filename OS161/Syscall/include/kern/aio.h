@@ -0,0 +1,65 @@
+#ifndef _KERN_AIO_H_
+#define _KERN_AIO_H_
+
+/*
+ * Asynchronous I/O rings, for aio_setup() and aio_enter().
+ *
+ * The user allocates a struct aio_ring and two arrays of ar_entries
+ * (a power of 2, at most AIO_MAXENTRIES) submission and completion
+ * entries, and passes the ring to aio_setup, which returns a
+ * descriptor for it. Requests are queued by filling in
+ * ar_sq[ar_sqtail % ar_entries] and advancing ar_sqtail; completions
+ * are consumed from ar_cq[ar_cqhead % ar_entries] by advancing
+ * ar_cqhead. The kernel advances ar_sqhead and ar_cqtail. The indices
+ * run freely and wrap at 2^32.
+ *
+ * aio_enter(fd, min_complete) submits everything between ar_sqhead
+ * and ar_sqtail that there is completion room for, waits until at
+ * least min_complete requests (of those in flight) have finished,
+ * posts every finished request to the completion queue, and returns
+ * the number submitted.
+ *
+ * Reads and writes move at most AIO_MAXIO bytes; longer ones come back
+ * short. An offset of -1 uses and advances the file's seek position.
+ * Reads and writes are only for seekable files; others fail with
+ * -ESPIPE.
+ */
+
+#define AIO_MAXENTRIES	64
+#define AIO_MAXIO	4096	/* one page */
+
+/* Operations */
+#define AIO_OP_NOP	0	/* completes with 0 */
+#define AIO_OP_READ	1
+#define AIO_OP_WRITE	2
+#define AIO_OP_FSYNC	3
+
+/* Submission queue entry */
+struct aio_sqe {
+	__i32 sqe_op;		/* AIO_OP_* */
+	__i32 sqe_fd;		/* descriptor to operate on */
+	__off_t sqe_offset;	/* file offset, or -1 */
+	void *sqe_buf;		/* user buffer for read and write */
+	__u32 sqe_len;		/* length of sqe_buf */
+	__u64 sqe_data;		/* handed back in the completion */
+};
+
+/* Completion queue entry */
+struct aio_cqe {
+	__u64 cqe_data;		/* sqe_data of the request */
+	__i32 cqe_res;		/* bytes moved, or -errno */
+	__i32 cqe_pad;
+};
+
+/* Ring header */
+struct aio_ring {
+	__u32 ar_sqhead;	/* next entry the kernel takes */
+	__u32 ar_sqtail;	/* next entry the user fills in */
+	__u32 ar_cqhead;	/* next completion the user reads */
+	__u32 ar_cqtail;	/* next completion the kernel posts */
+	__u32 ar_entries;	/* size of both queues */
+	struct aio_sqe *ar_sq;
+	struct aio_cqe *ar_cq;
+};
+
+#endif /* _KERN_AIO_H_ */
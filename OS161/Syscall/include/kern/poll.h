@@ -0,0 +1,34 @@
+#ifndef _KERN_POLL_H_
+#define _KERN_POLL_H_
+
+/*
+ * Definitions for poll() and select(), for <poll.h>, <sys/select.h>
+ * and the kernel.
+ */
+
+/* poll array entry */
+struct pollfd {
+	int fd;			/* descriptor, or negative to skip */
+	short events;		/* events to look for */
+	short revents;		/* events that happened */
+};
+
+/* poll events (POLLERR, POLLHUP and POLLNVAL are only for revents) */
+#define POLLIN		0x001	/* data to read */
+#define POLLPRI		0x002	/* urgent data to read */
+#define POLLOUT		0x004	/* room to write */
+#define POLLERR		0x008	/* error; for a pipe, no reader */
+#define POLLHUP		0x010	/* hung up; for a pipe, no writer */
+#define POLLNVAL	0x020	/* fd is not open */
+#define POLLRDNORM	0x040	/* same as POLLIN */
+#define POLLWRNORM	0x100	/* same as POLLOUT */
+
+/* select descriptor sets: bit (fd % 32) of word (fd / 32) */
+#define __FD_SETSIZE	1024
+#define __NFDBITS	32
+
+struct __fd_set {
+	__u32 fds_bits[__FD_SETSIZE / __NFDBITS];
+};
+
+#endif /* _KERN_POLL_H_ */
@@ -0,0 +1,31 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a ring buffer of PIPE_SIZE bytes with a vnode for each end,
+ * so descriptors for it are ordinary open files and read, write, close
+ * and dup2 work on them unchanged. The ring is PIPE_NPAGES separate
+ * pages and data is copied straight between it and user memory, one
+ * uiomove per page touched.
+ *
+ * Reads block until there is data or every write end is closed (end of
+ * file). Writes block until all the data is in; writes of PIPE_BUF
+ * bytes or less go in whole, not interleaved with other writers. With
+ * the read end closed, writes fail with EPIPE. Both ends support poll.
+ *
+ *    pipe_create - make a pipe, handing back the read and write vnodes,
+ *                  each holding one reference.
+ */
+
+#include <vm.h>
+
+#define PIPE_NPAGES 4
+#define PIPE_SIZE   (PIPE_NPAGES * PAGE_SIZE)
+
+struct vnode;
+
+int pipe_create(struct vnode **readvn, struct vnode **writevn);
+
+#endif /* _PIPE_H_ */
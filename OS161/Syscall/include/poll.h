@@ -0,0 +1,44 @@
+#ifndef _POLL_H_
+#define _POLL_H_
+
+/*
+ * Kernel side of poll() and select().
+ *
+ * Each object that can become ready (a pipe, say) has a pollqueue.
+ * Its VOP_POLL returns the events that are ready now and, if given a
+ * pollwaiter, calls poll_wait to put the waiter on its queue. Whenever
+ * the object's readiness may have changed it calls pollqueue_wakeup,
+ * which wakes every waiter on the queue. A thread polling many
+ * descriptors is on all their queues at once and sleeps once, on its
+ * own semaphore, until any of them (or its timeout) wakes it, then
+ * polls them all again.
+ *
+ * Objects without a VOP_POLL (regular files) are always ready.
+ *
+ *    pollqueue_init    - set up an empty queue.
+ *    pollqueue_cleanup - tear it down; nobody may be waiting.
+ *    pollqueue_wakeup  - wake everyone waiting on the queue. Does not
+ *                        sleep, so can be called with any lock held.
+ *    poll_wait         - called from VOP_POLL: put pw, which may be
+ *                        NULL, on the queue.
+ *    poll_hardclock    - may be called from hardclock, to expire timeouts
+ *                        on the tick instead of within a second.
+ */
+
+#include <spinlock.h>
+
+struct pollentry;
+struct pollwaiter;
+
+struct pollqueue {
+	struct spinlock pq_lock;
+	struct pollentry *pq_entries;
+};
+
+void pollqueue_init(struct pollqueue *pq);
+void pollqueue_cleanup(struct pollqueue *pq);
+void pollqueue_wakeup(struct pollqueue *pq);
+void poll_wait(struct pollwaiter *pw, struct pollqueue *pq);
+void poll_hardclock(void);
+
+#endif /* _POLL_H_ */
@@ -0,0 +1,54 @@
+#ifndef _SCRATCH_H_
+#define _SCRATCH_H_
+
+/*
+ * Per-thread scratch arena for transient syscall buffers (paths,
+ * iovec arrays). scratch_alloc bumps a pointer in a SCRATCH_SIZE
+ * buffer; nothing is freed individually. A syscall that uses the arena
+ * takes a mark on entry and releases back to it on every return path,
+ * which drops everything it allocated. The syscall dispatcher may also
+ * call scratch_reset as each call returns, in case some path missed
+ * its release.
+ *
+ * The buffer comes from a small shared pool when a syscall first needs
+ * it and goes back once everything is released, so a thread holds no
+ * arena memory between syscalls and one that exits leaks nothing.
+ *
+ * A request that doesn't fit is kmalloc'd and chained off the arena
+ * so that releasing frees it too, so callers need not check for
+ * anything but NULL.
+ *
+ *    scratch_init    - set up an empty arena; thread_create must call it
+ *                      before the thread makes its first syscall.
+ *    scratch_alloc   - get size bytes, aligned for any type, from the
+ *                      current thread's arena. Not for interrupt handlers.
+ *    scratch_mark    - remember how much of the arena is in use.
+ *    scratch_release - release everything allocated since MARK was taken.
+ *    scratch_reset   - release everything.
+ *    scratch_cleanup - release everything in SC, which need not be the
+ *                      current thread's (thread_destroy).
+ */
+
+#define SCRATCH_SIZE 4096
+
+struct scratch_big;
+
+struct scratch {
+	char *sc_base;			/* buffer, NULL while nothing is in use */
+	size_t sc_used;			/* bytes handed out since reset */
+	struct scratch_big *sc_big;	/* oversize allocations */
+};
+
+struct scratchmark {
+	size_t sm_used;
+	struct scratch_big *sm_big;
+};
+
+void scratch_init(struct scratch *sc);
+void *scratch_alloc(size_t size);
+void scratch_mark(struct scratchmark *mark);
+void scratch_release(const struct scratchmark *mark);
+void scratch_reset(void);
+void scratch_cleanup(struct scratch *sc);
+
+#endif /* _SCRATCH_H_ */
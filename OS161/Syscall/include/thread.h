@@ -42,12 +42,14 @@
 #include <threadlist.h>
 
 struct cpu;
+struct fdtable;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
 /* Extra include */
 #include <limits.h>
 #include <file.h>
+#include <scratch.h>
 /* Size of kernel stacks; must be power of 2 */
 #define STACK_SIZE 4096
 
@@ -109,7 +111,8 @@ struct thread {
 	 */
 
 	/* add more here as needed */
-	struct fdesc * fdtable[OPEN_MAX];
+	struct fdtable *fdtable;	/* Open files; see file.h */
+	struct scratch t_scratch;	/* Syscall scratch arena */
 };
 
 /*
@@ -0,0 +1,690 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/aio.h>
+#include <kern/fcntl.h>
+#include <kern/poll.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <openfile.h>
+#include <file.h>
+#include <poll.h>
+
+/*
+ * Asynchronous I/O rings. See kern/aio.h for the user's side.
+ *
+ * Kernel threads can't get at a process's memory, so the rings are
+ * only read and written by aio_enter, in the process's own context:
+ * it copies in the new submissions and copies out the completions, so
+ * one trap still carries any number of each. Each request gets a
+ * kernel buffer of AIO_MAXIO bytes at most, a single page; write data
+ * is copied into it at submission and read data out of it when the
+ * completion is posted.
+ *
+ * Requests go on a single queue served by AIO_NWORKERS kernel threads,
+ * each of which takes up to AIO_BATCH at a time. Finished requests go
+ * on their ring's done list until the next aio_enter posts them.
+ *
+ * A ring is a descriptor: its vnode is reclaimed when the last
+ * descriptor goes, which waits for the ring's requests to finish.
+ * Only the process that set it up may enter it, since the rings and
+ * buffers are addresses in that process's address space; a child that
+ * inherits the descriptor gets EBADF.
+ * It polls readable when there are completions to post.
+ */
+
+#define AIO_NWORKERS 2
+#define AIO_BATCH    8
+
+struct aioring;
+
+struct aioreq {
+    struct aioreq *rq_next;         // on aio_queue or ring_done
+    struct aioring *rq_ring;
+    struct openfile *rq_file;       // reference held while in flight
+    int rq_op;
+    off_t rq_offset;
+    userptr_t rq_ubuf;
+    size_t rq_len;
+    void *rq_kbuf;
+    uint64_t rq_data;
+    int rq_res;                     // bytes moved, or -errno
+};
+
+struct aioring {
+    struct proc *ring_proc;         // owner, and its address space
+    struct addrspace *ring_as;
+    userptr_t ring_user;            // the user's struct aio_ring
+    userptr_t ring_sq;
+    userptr_t ring_cq;
+    unsigned ring_entries;
+
+    struct lock *ring_enterlock;    // one aio_enter at a time, for:
+    uint32_t ring_sqhead;           // our copies of the kernel's indices
+    uint32_t ring_cqtail;
+
+    struct lock *ring_lock;         // for the fields below
+    struct cv *ring_cv;             // a request finished
+    unsigned ring_inflight;
+    unsigned ring_ndone;
+    struct aioreq *ring_done, **ring_donetail;
+
+    struct pollqueue ring_pollq;
+    struct vnode ring_vn;
+};
+
+// the request queue and its workers, started by the first aio_setup
+static struct spinlock aio_startlock = SPINLOCK_INITIALIZER;
+static unsigned aio_nworkers;       // protected by aio_lock
+static struct lock *aio_lock;
+static struct cv *aio_cv;
+static struct aioreq *aio_queue, **aio_queuetail = &aio_queue;
+
+static void aioreq_free(struct aioreq *rq) {
+    if(rq->rq_file != NULL) {
+        openfile_decref(rq->rq_file);
+    }
+    kfree(rq->rq_kbuf);
+    kfree(rq);
+}
+
+/*
+ * Put a finished request on its ring's done list.
+ */
+static void aio_finish(struct aioreq *rq, bool inflight) {
+    struct aioring *ring = rq->rq_ring;
+
+    lock_acquire(ring->ring_lock);
+    rq->rq_next = NULL;
+    *ring->ring_donetail = rq;
+    ring->ring_donetail = &rq->rq_next;
+    ring->ring_ndone++;
+    if(inflight) {
+        ring->ring_inflight--;
+    }
+    cv_broadcast(ring->ring_cv, ring->ring_lock);
+    pollqueue_wakeup(&ring->ring_pollq);
+    lock_release(ring->ring_lock);
+}
+
+static void aio_do(struct aioreq *rq) {
+    struct openfile *file = rq->rq_file;
+    struct vnode *vn = file->of_vnode;
+    enum uio_rw rw = (rq->rq_op == AIO_OP_READ) ? UIO_READ : UIO_WRITE;
+    struct iovec iov;
+    struct uio ku;
+    off_t pos;
+    int result;
+
+    if(rq->rq_op == AIO_OP_FSYNC) {
+        result = VOP_FSYNC(vn);
+        rq->rq_res = result ? -result : 0;
+        return;
+    }
+
+    /*
+     * With offset -1, claim rq_len bytes of the shared offset up front
+     * rather than hold of_offsetlock across the I/O, and after a short
+     * transfer give back the rest if nobody has moved the offset since.
+     */
+    pos = rq->rq_offset;
+    if(pos < 0) {
+        lock_acquire(file->of_offsetlock);
+        pos = file->of_offset;
+        file->of_offset = pos + rq->rq_len;
+        lock_release(file->of_offsetlock);
+    }
+    uio_kinit(&iov, &ku, rq->rq_kbuf, rq->rq_len, pos, rw);
+    result = (rw == UIO_READ) ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+    if(rq->rq_offset < 0 && ku.uio_resid > 0) {
+        lock_acquire(file->of_offsetlock);
+        if(file->of_offset == pos + (off_t)rq->rq_len) {
+            file->of_offset = ku.uio_offset;
+        }
+        lock_release(file->of_offsetlock);
+    }
+    // as with read and write, data moved before an error counts
+    if(result && ku.uio_resid == rq->rq_len) {
+        rq->rq_res = -result;
+    } else {
+        rq->rq_res = rq->rq_len - ku.uio_resid;
+    }
+}
+
+static void aio_worker(void *unused1, unsigned long unused2) {
+    struct aioreq *batch, *rq;
+    int n;
+
+    (void)unused1;
+    (void)unused2;
+
+    for(;;) {
+        lock_acquire(aio_lock);
+        while(aio_queue == NULL) {
+            cv_wait(aio_cv, aio_lock);
+        }
+        batch = aio_queue;
+        for(rq = batch, n = 1; rq->rq_next != NULL && n < AIO_BATCH; n++) {
+            rq = rq->rq_next;
+        }
+        aio_queue = rq->rq_next;
+        if(aio_queue == NULL) {
+            aio_queuetail = &aio_queue;
+        }
+        rq->rq_next = NULL;
+        lock_release(aio_lock);
+
+        while(batch != NULL) {
+            rq = batch;
+            batch = rq->rq_next;
+            aio_do(rq);
+            aio_finish(rq, true);
+        }
+    }
+}
+
+/*
+ * Make sure the queue and its workers exist. aio_lock and aio_cv are
+ * made once, by whoever gets there first; the workers are then forked
+ * under aio_lock, so a second caller sleeps on it until the first is
+ * done. If thread_fork fails we keep the workers we got, and the next
+ * aio_setup tries for the rest.
+ */
+static int aio_start(void) {
+    struct lock *lk = NULL;
+    struct cv *cv = NULL;
+    bool exists;
+    int result = 0;
+
+    spinlock_acquire(&aio_startlock);
+    exists = aio_lock != NULL;
+    spinlock_release(&aio_startlock);
+    if(!exists) {
+        lk = lock_create("aio");
+        cv = cv_create("aio");
+        if(lk != NULL && cv != NULL) {
+            spinlock_acquire(&aio_startlock);
+            if(aio_lock == NULL) {
+                aio_lock = lk;
+                aio_cv = cv;
+                lk = NULL;
+                cv = NULL;
+            }
+            spinlock_release(&aio_startlock);
+        } else {
+            result = ENOMEM;
+        }
+        // ours if we failed or lost the race
+        if(cv != NULL) {
+            cv_destroy(cv);
+        }
+        if(lk != NULL) {
+            lock_destroy(lk);
+        }
+        if(result) {
+            return result;
+        }
+    }
+
+    lock_acquire(aio_lock);
+    while(aio_nworkers < AIO_NWORKERS) {
+        result = thread_fork("aio worker", NULL, aio_worker, NULL,
+                             aio_nworkers);
+        if(result) {
+            break;
+        }
+        aio_nworkers++;
+    }
+    lock_release(aio_lock);
+    return result;
+}
+
+/*
+ * Turn a submission into a request: look up the file, check the
+ * access mode, and for writes copy the data in. A request that fails
+ * here gets its error in rq_res and goes straight to the done list.
+ * Reads and writes of non-seekable objects (pipes, the console) are
+ * refused: they can block indefinitely, and with a handful of workers
+ * shared by every ring, a few such requests would stall them all.
+ */
+static struct aioreq *aio_prepare(struct aioring *ring,
+                                  const struct aio_sqe *sqe) {
+    struct aioreq *rq;
+    struct openfile *file;
+    int result = 0;
+
+    rq = kmalloc(sizeof(struct aioreq));
+    if(rq == NULL) {
+        return NULL;
+    }
+    rq->rq_ring = ring;
+    rq->rq_file = NULL;
+    rq->rq_op = sqe->sqe_op;
+    rq->rq_offset = sqe->sqe_offset;
+    rq->rq_ubuf = (userptr_t)sqe->sqe_buf;
+    rq->rq_len = sqe->sqe_len > AIO_MAXIO ? AIO_MAXIO : sqe->sqe_len;
+    rq->rq_kbuf = NULL;
+    rq->rq_data = sqe->sqe_data;
+    rq->rq_res = 0;
+
+    switch(rq->rq_op) {
+        case AIO_OP_NOP:
+            return rq;
+        case AIO_OP_READ:
+        case AIO_OP_WRITE:
+        case AIO_OP_FSYNC:
+            break;
+        default:
+            result = EINVAL;
+            goto fail;
+    }
+
+    file = fdtable_get(curthread->fdtable, sqe->sqe_fd);
+    if(file == NULL ||
+       (rq->rq_op == AIO_OP_READ && file->of_accmode == O_WRONLY) ||
+       (rq->rq_op == AIO_OP_WRITE && file->of_accmode == O_RDONLY)) {
+        result = EBADF;
+        goto fail;
+    }
+    if(rq->rq_op != AIO_OP_FSYNC) {
+        if(rq->rq_offset < -1) {
+            result = EINVAL;
+            goto fail;
+        }
+        if(!VOP_ISSEEKABLE(file->of_vnode)) {
+            result = ESPIPE;
+            goto fail;
+        }
+        rq->rq_kbuf = kmalloc(rq->rq_len ? rq->rq_len : 1);
+        if(rq->rq_kbuf == NULL) {
+            result = ENOMEM;
+            goto fail;
+        }
+    }
+    if(rq->rq_op == AIO_OP_WRITE) {
+        result = copyin(rq->rq_ubuf, rq->rq_kbuf, rq->rq_len);
+        if(result) {
+            goto fail;
+        }
+    }
+    openfile_incref(file);
+    rq->rq_file = file;
+    return rq;
+
+fail:
+    kfree(rq->rq_kbuf);
+    rq->rq_kbuf = NULL;
+    rq->rq_op = AIO_OP_NOP;
+    rq->rq_res = -result;
+    return rq;
+}
+
+/*
+ * Copy out one finished request: read data to the user's buffer and
+ * the completion to the queue.
+ */
+static int aio_post(struct aioring *ring, struct aioreq *rq) {
+    struct aio_cqe cqe;
+    unsigned slot;
+    int result;
+
+    if(rq->rq_op == AIO_OP_READ && rq->rq_res > 0) {
+        result = copyout(rq->rq_kbuf, rq->rq_ubuf, rq->rq_res);
+        if(result) {
+            rq->rq_res = -result;
+        }
+    }
+    cqe.cqe_data = rq->rq_data;
+    cqe.cqe_res = rq->rq_res;
+    cqe.cqe_pad = 0;
+    slot = ring->ring_cqtail & (ring->ring_entries - 1);
+    return copyout(&cqe, ring->ring_cq + slot * sizeof(struct aio_cqe),
+                   sizeof(struct aio_cqe));
+}
+
+static struct aioring *aio_getring(int fd);
+
+static int aio_enter(struct aioring *ring, unsigned min_complete,
+                     int *retval) {
+
+    struct aio_ring *uring = (struct aio_ring *)ring->ring_user;
+    struct aioreq *rq, *done;
+    struct aio_sqe sqe;
+    struct aio_ring kring;
+    unsigned slot, nsub = 0, used;
+    int result;
+
+    // the process is in here, so the header holds still until we're done
+    result = copyin(ring->ring_user, &kring, sizeof(kring));
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+    if(kring.ar_sqtail - ring->ring_sqhead > ring->ring_entries ||
+       ring->ring_cqtail - kring.ar_cqhead > ring->ring_entries) {
+        *retval = -1;
+        return EINVAL;
+    }
+
+    // submit, as long as every request will have a completion slot
+    lock_acquire(ring->ring_lock);
+    used = ring->ring_inflight + ring->ring_ndone +
+           (ring->ring_cqtail - kring.ar_cqhead);
+    lock_release(ring->ring_lock);
+    while(ring->ring_sqhead != kring.ar_sqtail && used < ring->ring_entries) {
+        slot = ring->ring_sqhead & (ring->ring_entries - 1);
+        result = copyin(ring->ring_sq + slot * sizeof(struct aio_sqe),
+                        &sqe, sizeof(sqe));
+        if(result) {
+            break;
+        }
+        rq = aio_prepare(ring, &sqe);
+        if(rq == NULL) {
+            result = ENOMEM;
+            break;
+        }
+        ring->ring_sqhead++;
+        used++;
+        nsub++;
+
+        if(rq->rq_file == NULL) {
+            aio_finish(rq, false);
+            continue;
+        }
+        lock_acquire(ring->ring_lock);
+        ring->ring_inflight++;
+        lock_release(ring->ring_lock);
+        lock_acquire(aio_lock);
+        rq->rq_next = NULL;
+        *aio_queuetail = rq;
+        aio_queuetail = &rq->rq_next;
+        cv_signal(aio_cv, aio_lock);
+        lock_release(aio_lock);
+    }
+    if(result && nsub == 0) {
+        *retval = -1;
+        return result;
+    }
+
+    // wait, then take everything that's done
+    lock_acquire(ring->ring_lock);
+    while(ring->ring_ndone < min_complete && ring->ring_inflight > 0) {
+        cv_wait(ring->ring_cv, ring->ring_lock);
+    }
+    done = ring->ring_done;
+    ring->ring_done = NULL;
+    ring->ring_donetail = &ring->ring_done;
+    ring->ring_ndone = 0;
+    lock_release(ring->ring_lock);
+
+    result = 0;
+    while(done != NULL) {
+        rq = done;
+        result = aio_post(ring, rq);
+        if(result) {
+            break;
+        }
+        done = rq->rq_next;
+        ring->ring_cqtail++;
+        aioreq_free(rq);
+    }
+    if(done != NULL) {
+        // the completion queue is bad; keep the rest for next time
+        lock_acquire(ring->ring_lock);
+        *ring->ring_donetail = done;
+        for(rq = done; rq->rq_next != NULL; rq = rq->rq_next) {
+            ring->ring_ndone++;
+        }
+        ring->ring_ndone++;
+        ring->ring_donetail = &rq->rq_next;
+        lock_release(ring->ring_lock);
+    }
+
+    // only the kernel's two indices, never stale copies of the user's
+    if(result == 0) {
+        result = copyout(&ring->ring_sqhead,
+                         (userptr_t)&uring->ar_sqhead, sizeof(uint32_t));
+    }
+    if(result == 0) {
+        result = copyout(&ring->ring_cqtail,
+                         (userptr_t)&uring->ar_cqtail, sizeof(uint32_t));
+    }
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+    *retval = nsub;
+    return 0;
+}
+
+int sys_aio_enter(int fd, unsigned min_complete, int *retval) {
+
+    struct aioring *ring;
+    int result;
+
+    ring = aio_getring(fd);
+    if(ring == NULL) {
+        *retval = -1;
+        return EBADF;
+    }
+    lock_acquire(ring->ring_enterlock);
+    result = aio_enter(ring, min_complete, retval);
+    lock_release(ring->ring_enterlock);
+    return result;
+}
+
+static int aio_reclaim(struct vnode *vn) {
+    struct aioring *ring = vn->vn_data;
+    struct aioreq *rq;
+
+    // the workers still have pointers to the ring
+    lock_acquire(ring->ring_lock);
+    while(ring->ring_inflight > 0) {
+        cv_wait(ring->ring_cv, ring->ring_lock);
+    }
+    lock_release(ring->ring_lock);
+
+    while(ring->ring_done != NULL) {
+        rq = ring->ring_done;
+        ring->ring_done = rq->rq_next;
+        aioreq_free(rq);
+    }
+    vnode_cleanup(vn);
+    pollqueue_cleanup(&ring->ring_pollq);
+    cv_destroy(ring->ring_cv);
+    lock_destroy(ring->ring_lock);
+    lock_destroy(ring->ring_enterlock);
+    kfree(ring);
+    return 0;
+}
+
+static int aio_poll(struct vnode *vn, int events, struct pollwaiter *pw) {
+    struct aioring *ring = vn->vn_data;
+    int revents = 0;
+
+    lock_acquire(ring->ring_lock);
+    poll_wait(pw, &ring->ring_pollq);
+    if(ring->ring_ndone > 0) {
+        revents |= POLLIN | POLLRDNORM;
+    }
+    lock_release(ring->ring_lock);
+    return revents & events;
+}
+
+static int aio_eachopen(struct vnode *vn, int flags) {
+    (void)vn;
+    (void)flags;
+    return 0;
+}
+
+static int aio_ioctl(struct vnode *vn, int op, userptr_t data) {
+    (void)vn;
+    (void)op;
+    (void)data;
+    return EINVAL;
+}
+
+static int aio_stat(struct vnode *vn, struct stat *statbuf) {
+    (void)vn;
+    bzero(statbuf, sizeof(struct stat));
+    statbuf->st_nlink = 1;
+    return 0;
+}
+
+static int aio_gettype(struct vnode *vn, mode_t *result) {
+    (void)vn;
+    *result = 0;
+    return 0;
+}
+
+static bool aio_isseekable(struct vnode *vn) {
+    (void)vn;
+    return false;
+}
+
+static int aio_fsync(struct vnode *vn) {
+    (void)vn;
+    return 0;
+}
+
+static int aio_truncate(struct vnode *vn, off_t len) {
+    (void)vn;
+    (void)len;
+    return EINVAL;
+}
+
+static const struct vnode_ops aio_vnode_ops = {
+    .vop_magic = VOP_MAGIC,
+
+    .vop_eachopen = aio_eachopen,
+    .vop_reclaim = aio_reclaim,
+
+    .vop_read = vopfail_uio_inval,
+    .vop_readlink = vopfail_uio_inval,
+    .vop_getdirentry = vopfail_uio_notdir,
+    .vop_write = vopfail_uio_inval,
+    .vop_ioctl = aio_ioctl,
+    .vop_stat = aio_stat,
+    .vop_gettype = aio_gettype,
+    .vop_isseekable = aio_isseekable,
+    .vop_fsync = aio_fsync,
+    .vop_mmap = vopfail_mmap_perm,
+    .vop_truncate = aio_truncate,
+    .vop_namefile = vopfail_uio_inval,
+    .vop_poll = aio_poll,
+
+    .vop_creat = vopfail_creat_notdir,
+    .vop_symlink = vopfail_symlink_notdir,
+    .vop_mkdir = vopfail_mkdir_notdir,
+    .vop_link = vopfail_link_notdir,
+    .vop_remove = vopfail_string_notdir,
+    .vop_rmdir = vopfail_string_notdir,
+    .vop_rename = vopfail_rename_notdir,
+    .vop_lookup = vopfail_lookup_notdir,
+    .vop_lookparent = vopfail_lookparent_notdir,
+};
+
+static struct aioring *aio_getring(int fd) {
+    struct openfile *file;
+    struct aioring *ring;
+
+    file = fdtable_get(curthread->fdtable, fd);
+    if(file == NULL || file->of_vnode->vn_ops != &aio_vnode_ops) {
+        return NULL;
+    }
+    ring = file->of_vnode->vn_data;
+    if(ring->ring_proc != curproc || ring->ring_as != proc_getas()) {
+        return NULL;
+    }
+    return ring;
+}
+
+int sys_aio_setup(struct aio_ring *uring, int *retval) {
+
+    struct aio_ring kring;
+    struct aioring *ring;
+    struct openfile *file;
+    int result, fd;
+
+    result = copyin((const_userptr_t)uring, &kring, sizeof(kring));
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+    if(kring.ar_entries == 0 || kring.ar_entries > AIO_MAXENTRIES ||
+       (kring.ar_entries & (kring.ar_entries - 1)) != 0) {
+        *retval = -1;
+        return EINVAL;
+    }
+    result = aio_start();
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+
+    ring = kmalloc(sizeof(struct aioring));
+    if(ring == NULL) {
+        *retval = -1;
+        return ENOMEM;
+    }
+    ring->ring_proc = curproc;
+    ring->ring_as = proc_getas();
+    ring->ring_user = (userptr_t)uring;
+    ring->ring_sq = (userptr_t)kring.ar_sq;
+    ring->ring_cq = (userptr_t)kring.ar_cq;
+    ring->ring_entries = kring.ar_entries;
+    ring->ring_sqhead = 0;
+    ring->ring_cqtail = 0;
+    ring->ring_inflight = 0;
+    ring->ring_ndone = 0;
+    ring->ring_done = NULL;
+    ring->ring_donetail = &ring->ring_done;
+    ring->ring_enterlock = lock_create("aio enter");
+    ring->ring_lock = lock_create("aio ring");
+    ring->ring_cv = cv_create("aio ring");
+    if(ring->ring_enterlock == NULL || ring->ring_lock == NULL ||
+       ring->ring_cv == NULL ||
+       vnode_init(&ring->ring_vn, &aio_vnode_ops, NULL, ring)) {
+        if(ring->ring_cv != NULL) {
+            cv_destroy(ring->ring_cv);
+        }
+        if(ring->ring_lock != NULL) {
+            lock_destroy(ring->ring_lock);
+        }
+        if(ring->ring_enterlock != NULL) {
+            lock_destroy(ring->ring_enterlock);
+        }
+        kfree(ring);
+        *retval = -1;
+        return ENOMEM;
+    }
+    pollqueue_init(&ring->ring_pollq);
+
+    // start all four indices at zero
+    kring.ar_sqhead = kring.ar_sqtail = 0;
+    kring.ar_cqhead = kring.ar_cqtail = 0;
+    result = copyout(&kring, (userptr_t)uring, sizeof(kring));
+    if(result == 0) {
+        result = openfile_fromvnode(&ring->ring_vn, O_RDWR, &file);
+    }
+    if(result) {
+        VOP_DECREF(&ring->ring_vn);
+        *retval = -1;
+        return result;
+    }
+    result = fdtable_place(curthread->fdtable, file, &fd);
+    if(result) {
+        openfile_decref(file);
+        *retval = -1;
+        return result;
+    }
+    *retval = fd;
+    return 0;
+}
@@ -8,123 +8,379 @@
 #include <uio.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <openfile.h>
+#include <pipe.h>
 #include <file.h>
 #include <syscall.h>
 #include <copyinout.h>
+#include <scratch.h>
 
 /*
  * Add your file-related functions here ...
  */
+
+/*
+ * Set up a uio for I/O straight to or from the user buffer, so that
+ * VOP_READ/VOP_WRITE copy each byte once with no kernel buffer between.
+ */
+static void
+file_uio_uinit(struct iovec *iov, struct uio *u, userptr_t buf, size_t len,
+               off_t pos, enum uio_rw rw)
+{
+    iov->iov_ubase = buf;
+    iov->iov_len = len;
+    u->uio_iov = iov;
+    u->uio_iovcnt = 1;
+    u->uio_offset = pos;
+    u->uio_resid = len;
+    u->uio_segflg = UIO_USERSPACE;
+    u->uio_rw = rw;
+    u->uio_space = proc_getas();
+}
+
+/*
+ * Move size bytes between the user buffer and vn at *pos, advancing
+ * *pos, FILE_IOCHUNK bytes per VOP call, so a transfer of any size works and
+ * no single call runs for too long. A short chunk (end of file, a line
+ * from the console) ends the transfer. As with a short read or write,
+ * an error after some data has moved is not reported; the caller gets
+ * the byte count and sees the error on its next call.
+ * If pos is an open file's offset, hold its of_offsetlock.
+ */
+static int
+file_stream(struct vnode *vn, userptr_t buf, size_t size, off_t *pos,
+            enum uio_rw rw, size_t *done)
+{
+    struct iovec iov;
+    struct uio uu;
+    size_t len;
+    int result;
+
+    // the count must fit in the int return value
+    if (size > FILE_IOMAX) {
+        size = FILE_IOMAX;
+    }
+
+    *done = 0;
+    while (*done < size) {
+        len = size - *done;
+        if (len > FILE_IOCHUNK) {
+            len = FILE_IOCHUNK;
+        }
+        file_uio_uinit(&iov, &uu, buf + *done, len, *pos, rw);
+        result = (rw == UIO_READ) ? VOP_READ(vn, &uu) : VOP_WRITE(vn, &uu);
+        // whatever moved before an error still counts
+        *done += len - uu.uio_resid;
+        *pos = uu.uio_offset;
+        if (result) {
+            return *done > 0 ? 0 : result;
+        }
+        if (uu.uio_resid > 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Descriptor table. fdt_inuse has one bit per descriptor and fdt_full one
+ * bit per word of fdt_inuse, set while that word is all ones. So the
+ * lowest free descriptor is found with two find-first-zeroes, however
+ * many are open. The table starts with FDTABLE_MIN slots and doubles when
+ * it fills, up to FDTABLE_MAX, where fdt_full is still a single word.
+ */
+static int
+fdtable_ffz(uint32_t word)
+{
+    KASSERT(word != 0xffffffff);
+    return __builtin_ctz(~word);
+}
+
+struct fdtable *
+fdtable_create(void)
+{
+    struct fdtable *ft;
+
+    ft = kmalloc(sizeof(struct fdtable));
+    if (ft == NULL) {
+        return NULL;
+    }
+    ft->fdt_files = kmalloc(FDTABLE_MIN * sizeof(struct openfile *));
+    ft->fdt_inuse = kmalloc(FDTABLE_MIN / 32 * sizeof(uint32_t));
+    if (ft->fdt_files == NULL || ft->fdt_inuse == NULL) {
+        kfree(ft->fdt_files);
+        kfree(ft->fdt_inuse);
+        kfree(ft);
+        return NULL;
+    }
+    bzero(ft->fdt_files, FDTABLE_MIN * sizeof(struct openfile *));
+    bzero(ft->fdt_inuse, FDTABLE_MIN / 32 * sizeof(uint32_t));
+    ft->fdt_full = 0;
+    ft->fdt_size = FDTABLE_MIN;
+    return ft;
+}
+
+/*
+ * Drop the table's reference on each open file, and free the table.
+ */
+void
+fdtable_destroy(struct fdtable *ft)
+{
+    unsigned i;
+
+    for (i = 0; i < ft->fdt_size; i++) {
+        if (ft->fdt_files[i] != NULL) {
+            openfile_decref(ft->fdt_files[i]);
+        }
+    }
+    kfree(ft->fdt_files);
+    kfree(ft->fdt_inuse);
+    kfree(ft);
+}
+
+/*
+ * Make the table big enough for descriptor fd.
+ */
+static int
+fdtable_grow(struct fdtable *ft, int fd)
+{
+    struct openfile **files;
+    uint32_t *inuse;
+    unsigned size;
+
+    if (fd >= FDTABLE_MAX) {
+        return EMFILE;
+    }
+    size = ft->fdt_size;
+    while ((unsigned)fd >= size) {
+        size *= 2;
+    }
+    if (size == ft->fdt_size) {
+        return 0;
+    }
+
+    files = kmalloc(size * sizeof(struct openfile *));
+    inuse = kmalloc(size / 32 * sizeof(uint32_t));
+    if (files == NULL || inuse == NULL) {
+        kfree(files);
+        kfree(inuse);
+        return ENOMEM;
+    }
+    bzero(files, size * sizeof(struct openfile *));
+    bzero(inuse, size / 32 * sizeof(uint32_t));
+    memcpy(files, ft->fdt_files, ft->fdt_size * sizeof(struct openfile *));
+    memcpy(inuse, ft->fdt_inuse, ft->fdt_size / 32 * sizeof(uint32_t));
+    kfree(ft->fdt_files);
+    kfree(ft->fdt_inuse);
+    ft->fdt_files = files;
+    ft->fdt_inuse = inuse;
+    ft->fdt_size = size;
+    return 0;
+}
+
+static void
+fdtable_set(struct fdtable *ft, int fd, struct openfile *file)
+{
+    unsigned word = fd / 32;
+
+    KASSERT((unsigned)fd < ft->fdt_size && ft->fdt_files[fd] == NULL);
+    ft->fdt_files[fd] = file;
+    ft->fdt_inuse[word] |= (uint32_t)1 << (fd % 32);
+    if (ft->fdt_inuse[word] == 0xffffffff) {
+        ft->fdt_full |= (uint32_t)1 << word;
+    }
+}
+
+/*
+ * Put file in the lowest free descriptor.
+ */
+int
+fdtable_place(struct fdtable *ft, struct openfile *file, int *fd)
+{
+    unsigned word;
+    int result;
+
+    word = (ft->fdt_full == 0xffffffff) ? 32 : fdtable_ffz(ft->fdt_full);
+    if (word >= ft->fdt_size / 32) {
+        // everything is in use; the next descriptor is the first new one
+        result = fdtable_grow(ft, ft->fdt_size);
+        if (result) {
+            return result;
+        }
+    }
+    *fd = word * 32 + fdtable_ffz(ft->fdt_inuse[word]);
+    fdtable_set(ft, *fd, file);
+    return 0;
+}
+
+/*
+ * Put file in descriptor fd, which must be free.
+ */
+int
+fdtable_placeat(struct fdtable *ft, struct openfile *file, int fd)
+{
+    int result;
+
+    if (fd < 0) {
+        return EBADF;
+    }
+    result = fdtable_grow(ft, fd);
+    if (result) {
+        return result == EMFILE ? EBADF : result;
+    }
+    fdtable_set(ft, fd, file);
+    return 0;
+}
+
+/*
+ * Take the file out of descriptor fd and return it.
+ */
+struct openfile *
+fdtable_remove(struct fdtable *ft, int fd)
+{
+    struct openfile *file;
+    unsigned word = fd / 32;
+
+    file = fdtable_get(ft, fd);
+    KASSERT(file != NULL);
+    ft->fdt_files[fd] = NULL;
+    ft->fdt_inuse[word] &= ~((uint32_t)1 << (fd % 32));
+    ft->fdt_full &= ~((uint32_t)1 << word);
+    return file;
+}
+
+struct openfile *
+fdtable_get(struct fdtable *ft, int fd)
+{
+    if (fd < 0 || (unsigned)fd >= ft->fdt_size) {
+        return NULL;
+    }
+    return ft->fdt_files[fd];
+}
+
+/*
+ * Clone a table for fork. The child gets the same open files, not
+ * copies, so parent and child share offsets as they should.
+ */
+int
+fdtable_copy(struct fdtable *src, struct fdtable **dest_ret)
+{
+    struct fdtable *ft;
+    unsigned i;
+    int result;
+
+    ft = fdtable_create();
+    if (ft == NULL) {
+        return ENOMEM;
+    }
+    result = fdtable_grow(ft, src->fdt_size - 1);
+    if (result) {
+        fdtable_destroy(ft);
+        return result;
+    }
+    for (i = 0; i < src->fdt_size; i++) {
+        if (src->fdt_files[i] != NULL) {
+            openfile_incref(src->fdt_files[i]);
+        }
+    }
+    memcpy(ft->fdt_files, src->fdt_files,
+           src->fdt_size * sizeof(struct openfile *));
+    memcpy(ft->fdt_inuse, src->fdt_inuse,
+           src->fdt_size / 32 * sizeof(uint32_t));
+    ft->fdt_full = src->fdt_full;
+    *dest_ret = ft;
+    return 0;
+}
+
+/*
+ * Give a new thread a descriptor table with the console open on 0, 1
+ * and 2. On failure nothing is left behind and nt->fdtable is NULL.
+ */
 int filetable_init (struct thread* nt){
+    struct openfile* file;
+    char* fname;
+    int result;
+
+    nt->fdtable = fdtable_create();
+    if (nt->fdtable == NULL){
+        return ENOMEM;
+    }
     for (int i = 0; i < 3; ++i){
-        struct vnode* vn;
-        char* fname = kstrdup ("con:");
-        if (vfs_open(fname, i?O_WRONLY:O_RDONLY, 0, &vn)){
-            kfree (fname);
-            return EINVAL;
-        }
-    
-        void* ptr= kmalloc (sizeof (struct fdesc)); 
-        if (!ptr){
-            vfs_close (vn);
-            kfree (fname);
-            return EINVAL;
+        fname = kstrdup ("con:");
+        if (fname == NULL){
+            result = ENOMEM;
+            goto fail;
         }
-        nt -> fdtable[i] = ptr;
-        strcpy (nt->fdtable[i]->file_name,fname);
+        result = openfile_open(fname, i?O_WRONLY:O_RDONLY, 0, &file);
         kfree (fname);
-        *(nt -> fdtable[i]) = (struct fdesc)
-        {
-            .vn = vn,
-            .flags = i? O_WRONLY:O_RDONLY,
-            .offset = 0,
-            .refcount = 1,
-            .lk = lock_create(fname)
-        };
+        if (result){
+            goto fail;
+        }
+        result = fdtable_placeat(nt->fdtable, file, i);
+        if (result){
+            openfile_decref(file);
+            goto fail;
+        }
     }
     return 0;
+
+fail:
+    // drops the descriptors already placed
+    fdtable_destroy(nt->fdtable);
+    nt->fdtable = NULL;
+    return result;
 }
 
 int sys_open(const char *filename, int flags, mode_t mode, int *retval) {
 
-    int result=0, index = 3;
-    struct vnode *vn;
+    int result=0, index;
+    struct openfile *file;
+    struct scratchmark mark;
     char *kbuf;
     size_t len;
-    kbuf = (char *) kmalloc(sizeof(char)*PATH_MAX);
+    scratch_mark(&mark);
+    kbuf = scratch_alloc(PATH_MAX);
+    if(kbuf == NULL) {
+        scratch_release(&mark);
+        *retval = -1;
+        return ENOMEM;
+    }
     result = copyinstr((const_userptr_t)filename,kbuf, PATH_MAX, &len);
     if(result) {
-        kfree(kbuf);
+        scratch_release(&mark);
         *retval = -1;
         return EFAULT;
     }
 
-    while (curthread->fdtable[index] != NULL ) {
-        index++;
-    }
-
-    if(index >= OPEN_MAX) {
-        kfree(kbuf);
-        *retval = -1;
-        return ENFILE;
-    }
-
-    curthread->fdtable[index] = (struct fdesc *)kmalloc(sizeof(struct fdesc*));
-    if(curthread->fdtable[index] == NULL) {
-        kfree(kbuf);
+    result = openfile_open(kbuf, flags, mode, &file);
+    scratch_release(&mark);
+    if(result) {
         *retval = -1;
-        return ENFILE;
+        return result;
     }
 
-    result = vfs_open(kbuf,flags,mode,&vn);
+    result = fdtable_place(curthread->fdtable, file, &index);
     if(result) {
-        kfree(kbuf);
-        kfree(curthread->fdtable[index]);
-        curthread->fdtable[index] = NULL;
+        openfile_decref(file);
         *retval = -1;
         return result;
     }
-
-    curthread->fdtable[index]->vn = vn;
-    strcpy(curthread->fdtable[index]->file_name, kbuf);
-    curthread->fdtable[index]->flags = flags;
-    curthread->fdtable[index]->refcount = 1;
-    curthread->fdtable[index]->offset = 0;
-    curthread->fdtable[index]->lk= lock_create(kbuf);
     *retval = index;
-    kfree(kbuf);
     return 0;
 }
 
 int sys_close(int filehandle, int *retval) {
 
-    if(filehandle >= OPEN_MAX || filehandle < 0) {
-        *retval = -1;
-        return EBADF;
-    }
-
-    if(curthread->fdtable[filehandle] == NULL) {
+    if(fdtable_get(curthread->fdtable, filehandle) == NULL) {
         *retval = -1;
         return EBADF;
     }
 
-    if(curthread->fdtable[filehandle]->vn == NULL) {
-        *retval = -1;
-        return EBADF;
-    }
-
-    if(curthread->fdtable[filehandle]->refcount == 1) {
-        vfs_close(curthread->fdtable[filehandle]->vn);
-        lock_destroy(curthread->fdtable[filehandle]->lk);
-        kfree(curthread->fdtable[filehandle]);
-        curthread->fdtable[filehandle] = NULL;
-    } else {
-        curthread->fdtable[filehandle]->refcount -= 1;
-    }
-
+    openfile_decref(fdtable_remove(curthread->fdtable, filehandle));
     *retval = 0;
     return 0;
 }
@@ -136,130 +392,261 @@ int sys_read(int filehandle, void *buf, size_t size, int *retval) {
         return EFAULT;
     }
 
-    if(filehandle >= OPEN_MAX || filehandle < 0) {
+    struct openfile *file = fdtable_get(curthread->fdtable, filehandle);
+    if(file == NULL) {
         *retval = -1;
         return EBADF;
     }
 
-    if(curthread->fdtable[filehandle] == NULL) {
+    if (file->of_accmode == O_WRONLY) {
         *retval = -1;
         return EBADF;
     }
 
-    if (curthread->fdtable[filehandle]->flags == O_WRONLY || curthread->fdtable[filehandle]->flags == (O_WRONLY | O_CREAT) || curthread->fdtable[filehandle]->flags == (O_WRONLY | O_EXCL) || curthread->fdtable[filehandle]->flags == (O_WRONLY | O_TRUNC) || curthread->fdtable[filehandle]->flags == (O_WRONLY | O_APPEND)) {
+    size_t done;
+    int result;
+
+    lock_acquire(file->of_offsetlock);
+    // a bad user buffer shows up here as EFAULT from uiomove
+    result = file_stream(file->of_vnode, (userptr_t)buf, size,
+                         &file->of_offset, UIO_READ, &done);
+    lock_release(file->of_offsetlock);
+    if(result) {
         *retval = -1;
-        return EBADF;
+        return result;
     }
+    *retval = done;
+    return 0;
 
-    struct iovec iov;
-    struct uio ku;
-    char *kbuf = (char*)kmalloc(size);
-    if(kbuf == NULL) {
+}
+
+int sys_write(int filehandle, const void *buf, size_t size, int *retval) {
+    if(buf == NULL) {
         *retval = -1;
         return EFAULT;
     }
-    //check user buf
-    int result = copyin((const_userptr_t)buf,kbuf,size);
-    if(result) {
-        kfree(kbuf);
+    struct openfile *file = fdtable_get(curthread->fdtable, filehandle);
+    if(file == NULL) {
         *retval = -1;
-        return result;
+        return EBADF;
     }
 
-    lock_acquire(curthread->fdtable[filehandle]->lk);
-    uio_kinit(&iov, &ku, (void*)kbuf, size ,curthread->fdtable[filehandle]->offset,UIO_READ);
-    
-    result = VOP_READ(curthread->fdtable[filehandle]->vn, &ku);
-    if(result) {
+    if (file->of_accmode == O_RDONLY) {
         *retval = -1;
-        kfree(kbuf);
-        lock_release(curthread->fdtable[filehandle]->lk);
-        return result;
+        return EBADF;
     }
 
-            
-    curthread->fdtable[filehandle]->offset = ku.uio_offset;
 
-    result = copyout((const void *)kbuf, (userptr_t)buf, size);
+    size_t done;
+    int result;
+
+    lock_acquire(file->of_offsetlock);
+    result = file_stream(file->of_vnode, (userptr_t)buf, size,
+                         &file->of_offset, UIO_WRITE, &done);
+    lock_release(file->of_offsetlock);
     if(result) {
         *retval = -1;
-        kfree(kbuf);
-        lock_release(curthread->fdtable[filehandle]->lk);
         return result;
     }
-    *retval = size - ku.uio_resid;
-    kfree(kbuf);
-    lock_release(curthread->fdtable[filehandle]->lk);
+    *retval = done;
     return 0;
-
 }
 
-int sys_write(int filehandle, const void *buf, size_t size, int *retval) {
-    if(buf == NULL) {
+/*
+ * Positional I/O for pread/pwrite: transfer at pos, leaving the
+ * descriptor's offset alone. As the shared offset is neither read nor
+ * written, of_offsetlock is not taken, and any number of threads can work
+ * on different parts of the same file at once.
+ */
+static int file_prw(int filehandle, userptr_t buf, size_t size, off_t pos,
+                    enum uio_rw rw, int *retval) {
+
+    struct openfile *file;
+    size_t done;
+    int result;
+
+    file = fdtable_get(curthread->fdtable, filehandle);
+    if(file == NULL) {
         *retval = -1;
-        return EFAULT;
+        return EBADF;
     }
-    if(filehandle >= OPEN_MAX || filehandle < 0) {
+
+    if(file->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
         *retval = -1;
         return EBADF;
     }
+    if(!VOP_ISSEEKABLE(file->of_vnode)) {
+        *retval = -1;
+        return ESPIPE;
+    }
+    if(pos < 0) {
+        *retval = -1;
+        return EINVAL;
+    }
 
-    if(curthread->fdtable[filehandle] == NULL) {
+    result = file_stream(file->of_vnode, buf, size, &pos, rw, &done);
+    if(result) {
         *retval = -1;
-        return EBADF;
+        return result;
     }
+    *retval = done;
+    return 0;
+}
+
+int sys_pread(int filehandle, void *buf, size_t size, off_t pos, int *retval) {
+    return file_prw(filehandle, (userptr_t)buf, size, pos, UIO_READ, retval);
+}
 
-    if (curthread->fdtable[filehandle]->flags == O_RDONLY || curthread->fdtable[filehandle]->flags == (O_RDONLY | O_CREAT) || curthread->fdtable[filehandle]->flags == (O_RDONLY | O_EXCL) || curthread->fdtable[filehandle]->flags == (O_RDONLY | O_TRUNC) || curthread->fdtable[filehandle]->flags == (O_RDONLY | O_APPEND)) {
+int sys_pwrite(int filehandle, const void *buf, size_t size, off_t pos, int *retval) {
+    return file_prw(filehandle, (userptr_t)buf, size, pos, UIO_WRITE, retval);
+}
+
+/*
+ * readv/writev: copy in the user's iovec array and hand the whole thing
+ * to one VOP_READ/VOP_WRITE as a multi-iovec uio over user memory.
+ * Short arrays are copied onto the stack and longer ones into the
+ * scratch arena.
+ */
+static int file_rwv(int filehandle, const struct iovec *uiov, int iovcnt,
+                    enum uio_rw rw, int *retval) {
+
+    struct iovec stackiov[FILE_IOVSTACK], *iov;
+    struct scratchmark mark;
+    struct openfile *file;
+    struct uio uu;
+    size_t total = 0;
+    int i, result;
+
+    file = fdtable_get(curthread->fdtable, filehandle);
+    if(file == NULL) {
         *retval = -1;
         return EBADF;
     }
 
-
-    struct iovec iov;
-    struct uio ku;
-    char *kbuf = (char*)kmalloc(size);
-    if(kbuf == NULL) {
+    if(file->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
+        *retval = -1;
+        return EBADF;
+    }
+    if(iovcnt <= 0 || iovcnt > IOV_MAX) {
         *retval = -1;
         return EINVAL;
     }
 
-    lock_acquire(curthread->fdtable[filehandle]->lk);
+    scratch_mark(&mark);
+    iov = stackiov;
+    if(iovcnt > FILE_IOVSTACK) {
+        iov = scratch_alloc(iovcnt * sizeof(struct iovec));
+        if(iov == NULL) {
+            result = ENOMEM;
+            goto out;
+        }
+    }
+    result = copyin((const_userptr_t)uiov, iov, iovcnt * sizeof(struct iovec));
+    if(result) {
+        goto out;
+    }
+    // the total must fit in the return value
+    for(i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len > FILE_IOMAX - total) {
+            result = EINVAL;
+            goto out;
+        }
+        total += iov[i].iov_len;
+    }
+
+    lock_acquire(file->of_offsetlock);
+    uu.uio_iov = iov;
+    uu.uio_iovcnt = iovcnt;
+    uu.uio_offset = file->of_offset;
+    uu.uio_resid = total;
+    uu.uio_segflg = UIO_USERSPACE;
+    uu.uio_rw = rw;
+    uu.uio_space = proc_getas();
+    result = (rw == UIO_READ) ? VOP_READ(file->of_vnode, &uu) : VOP_WRITE(file->of_vnode, &uu);
+    file->of_offset = uu.uio_offset;
+    lock_release(file->of_offsetlock);
+
+    // as in file_stream, data moved before an error counts
+    if(result && uu.uio_resid < total) {
+        result = 0;
+    }
+    *retval = total - uu.uio_resid;
 
-    int result = copyin((const_userptr_t)buf,kbuf,size);
+out:
+    scratch_release(&mark);
     if(result) {
-        kfree(kbuf);
-        lock_release(curthread->fdtable[filehandle]->lk);
         *retval = -1;
-        return result;
     }
+    return result;
+}
 
-    uio_kinit(&iov, &ku, kbuf, size ,curthread->fdtable[filehandle]->offset,UIO_WRITE);
+int sys_readv(int filehandle, const struct iovec *iov, int iovcnt, int *retval) {
+    return file_rwv(filehandle, iov, iovcnt, UIO_READ, retval);
+}
 
-    result = VOP_WRITE(curthread->fdtable[filehandle]->vn, &ku);
+int sys_writev(int filehandle, const struct iovec *iov, int iovcnt, int *retval) {
+    return file_rwv(filehandle, iov, iovcnt, UIO_WRITE, retval);
+}
+
+/*
+ * Make a pipe and put its read and write ends in the two lowest free
+ * descriptors, which go back to the user in fds[0] and fds[1].
+ */
+int sys_pipe(int *fds, int *retval) {
+
+    struct vnode *readvn, *writevn;
+    struct openfile *readfile, *writefile;
+    int kfds[2], result;
+
+    result = pipe_create(&readvn, &writevn);
     if(result) {
-        kfree(kbuf);
-        lock_release(curthread->fdtable[filehandle]->lk);
+        *retval = -1;
+        return result;
+    }
+    result = openfile_fromvnode(readvn, O_RDONLY, &readfile);
+    if(result) {
+        VOP_DECREF(readvn);
+        VOP_DECREF(writevn);
+        *retval = -1;
+        return result;
+    }
+    result = openfile_fromvnode(writevn, O_WRONLY, &writefile);
+    if(result) {
+        openfile_decref(readfile);
+        VOP_DECREF(writevn);
         *retval = -1;
         return result;
     }
 
-    curthread->fdtable[filehandle]->offset = ku.uio_offset;
-
-    *retval = size - ku.uio_resid;
-
-    kfree(kbuf);
-    lock_release(curthread->fdtable[filehandle]->lk);
+    result = fdtable_place(curthread->fdtable, readfile, &kfds[0]);
+    if(result) {
+        goto fail;
+    }
+    result = fdtable_place(curthread->fdtable, writefile, &kfds[1]);
+    if(result) {
+        fdtable_remove(curthread->fdtable, kfds[0]);
+        goto fail;
+    }
+    result = copyout(kfds, (userptr_t)fds, sizeof(kfds));
+    if(result) {
+        fdtable_remove(curthread->fdtable, kfds[1]);
+        fdtable_remove(curthread->fdtable, kfds[0]);
+        goto fail;
+    }
+    *retval = 0;
     return 0;
+
+fail:
+    openfile_decref(writefile);
+    openfile_decref(readfile);
+    *retval = -1;
+    return result;
 }
 
 int sys_lseek(int filehandle, off_t pos, int whence, int *retval, int *retval1) {
 
-    if(filehandle >= OPEN_MAX || filehandle < 0) {
-        *retval = -1;
-        return EBADF;
-    }
-
-    if(curthread->fdtable[filehandle] == NULL) {
+    struct openfile *file = fdtable_get(curthread->fdtable, filehandle);
+    if(file == NULL) {
         *retval = -1;
         return EBADF;
     }
@@ -268,10 +655,10 @@ int sys_lseek(int filehandle, off_t pos, int whence, int *retval, int *retval1)
     off_t offset;
     struct stat statbuf;
 
-    lock_acquire(curthread->fdtable[filehandle]->lk);
+    lock_acquire(file->of_offsetlock);
 
-    if(!VOP_ISSEEKABLE(curthread->fdtable[filehandle]->vn)){
-        lock_release(curthread->fdtable[filehandle]->lk);
+    if(!VOP_ISSEEKABLE(file->of_vnode)){
+        lock_release(file->of_offsetlock);
         *retval = -1;
         return ESPIPE;
     }
@@ -281,13 +668,13 @@ int sys_lseek(int filehandle, off_t pos, int whence, int *retval, int *retval1)
             break;
 
         case SEEK_CUR:
-            offset = curthread->fdtable[filehandle]->offset + pos;
+            offset = file->of_offset + pos;
             break;
 
         case SEEK_END:
-            result = VOP_STAT(curthread->fdtable[filehandle]->vn, &statbuf);
+            result = VOP_STAT(file->of_vnode, &statbuf);
             if(result) {
-                lock_release(curthread->fdtable[filehandle]->lk);
+                lock_release(file->of_offsetlock);
                 *retval = -1;
                 return result;
             }
@@ -295,7 +682,7 @@ int sys_lseek(int filehandle, off_t pos, int whence, int *retval, int *retval1)
             break;
         
         default:
-            lock_release(curthread->fdtable[filehandle]->lk);
+            lock_release(file->of_offsetlock);
             *retval = -1;
             return EINVAL;
             break;
@@ -303,18 +690,22 @@ int sys_lseek(int filehandle, off_t pos, int whence, int *retval, int *retval1)
 
     if(offset < (off_t)0) {
         *retval = -1;
-        lock_release(curthread->fdtable[filehandle]->lk);
+        lock_release(file->of_offsetlock);
         return EINVAL;
     }
-    curthread->fdtable[filehandle]->offset = offset;
+    file->of_offset = offset;
     *retval = (uint32_t)((offset & 0xFFFFFFFF00000000) >> 32);
     *retval1 = (uint32_t)(offset & 0xFFFFFFFF);
-    lock_release(curthread->fdtable[filehandle]->lk);
+    lock_release(file->of_offsetlock);
     return 0;
 }
 
+/*
+ * new_fd becomes another reference to fd's open file, sharing its
+ * offset; whatever was open at new_fd is closed first.
+ */
 int sys_dup2(int fd, int new_fd, int* retval){
-    int err = check_fd(fd, O_RDONLY, retval);
+    int err = check_fd(fd, -1, retval);
     if(err) return err;
     err = check_fd(new_fd,-2, retval);
     if(err) return err;
@@ -324,28 +715,29 @@ int sys_dup2(int fd, int new_fd, int* retval){
         return 0;
     }
 
-    if(curthread->fdtable[new_fd] != NULL){
-        sys_close(new_fd, retval);
-        return EBADF;
-    }   
-
-    lock_acquire(curthread->fdtable[fd]->lk);
-    curthread->fdtable[new_fd] = (struct fdesc *)kmalloc(sizeof(struct fdesc*));
-    strcpy(curthread->fdtable[new_fd]->file_name, curthread->fdtable[fd]->file_name);
-    curthread->fdtable[new_fd]->offset = curthread->fdtable[fd]->offset;
-    curthread->fdtable[new_fd]->lk = lock_create("new_fd");
-    curthread->fdtable[new_fd]->vn = curthread->fdtable[fd]->vn;
-    curthread->fdtable[new_fd]->flags = curthread->fdtable[fd]->flags;
-    curthread->fdtable[fd]->refcount += 1;
-    curthread->fdtable[new_fd]->refcount = curthread->fdtable[fd]->refcount;
+    struct openfile *file = fdtable_get(curthread->fdtable, fd);
+    struct openfile *oldfile = fdtable_get(curthread->fdtable, new_fd);
+
+    // with new_fd open the table already covers it, so placeat can't fail
+    if(oldfile != NULL){
+        fdtable_remove(curthread->fdtable, new_fd);
+    }
+    err = fdtable_placeat(curthread->fdtable, file, new_fd);
+    if(err) {
+        *retval = -1;
+        return err;
+    }
+    openfile_incref(file);
+    if(oldfile != NULL){
+        openfile_decref(oldfile);
+    }
     *retval = new_fd;
-    lock_release(curthread->fdtable[fd]->lk);
     return 0;   
 }
 
 int check_fd(int fd, int mode, int* retval){
 
-    if(fd<0||fd>=OPEN_MAX){
+    if(fd<0||fd>=FDTABLE_MAX){
         *retval = -1;
         return EBADF;
     }
@@ -353,15 +745,16 @@ int check_fd(int fd, int mode, int* retval){
         return 0;
     }
     
-    if(curthread->fdtable[fd] == NULL){
+    struct openfile *file = fdtable_get(curthread->fdtable, fd);
+    if(file == NULL){
         *retval = -1;
         return EBADF;
     }
     if(mode == -1) //for close
         return 0;
-    if(curthread->fdtable[fd]->flags == O_RDWR)
+    if(file->of_accmode == O_RDWR)
         return 0;
-    if(mode != curthread->fdtable[fd]->flags){
+    if(mode != file->of_accmode){
         *retval = -1;
         return EINVAL;
     }
@@ -0,0 +1,81 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <openfile.h>
+
+/*
+ * Open file objects. A descriptor table slot holds a reference; dup2
+ * and fork share the object by taking another, so all of them see the
+ * same offset. The refcount is changed under of_reflock only, never
+ * of_offsetlock, so sharing a file costs no lock allocation and does
+ * not wait behind I/O in progress.
+ */
+
+int openfile_open(char *filename, int openflags, mode_t mode,
+                  struct openfile **ret) {
+
+    struct vnode *vn;
+    int result;
+
+    result = vfs_open(filename, openflags, mode, &vn);
+    if(result) {
+        return result;
+    }
+    result = openfile_fromvnode(vn, openflags & O_ACCMODE, ret);
+    if(result) {
+        vfs_close(vn);
+        return result;
+    }
+    return 0;
+}
+
+int openfile_fromvnode(struct vnode *vn, int accmode, struct openfile **ret) {
+
+    struct openfile *file;
+
+    file = kmalloc(sizeof(struct openfile));
+    if(file == NULL) {
+        return ENOMEM;
+    }
+    file->of_offsetlock = lock_create("openfile");
+    if(file->of_offsetlock == NULL) {
+        kfree(file);
+        return ENOMEM;
+    }
+
+    file->of_vnode = vn;
+    file->of_accmode = accmode;
+    file->of_offset = 0;
+    spinlock_init(&file->of_reflock);
+    file->of_refcount = 1;
+
+    *ret = file;
+    return 0;
+}
+
+void openfile_incref(struct openfile *file) {
+    spinlock_acquire(&file->of_reflock);
+    file->of_refcount++;
+    spinlock_release(&file->of_reflock);
+}
+
+void openfile_decref(struct openfile *file) {
+    int refcount;
+
+    spinlock_acquire(&file->of_reflock);
+    KASSERT(file->of_refcount > 0);
+    refcount = --file->of_refcount;
+    spinlock_release(&file->of_reflock);
+
+    // last reference: nobody else can reach the file now
+    if(refcount == 0) {
+        vfs_close(file->of_vnode);
+        lock_destroy(file->of_offsetlock);
+        spinlock_cleanup(&file->of_reflock);
+        kfree(file);
+    }
+}
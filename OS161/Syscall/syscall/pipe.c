@@ -0,0 +1,336 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <limits.h>
+#include <kern/stat.h>
+#include <kern/stattypes.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <poll.h>
+#include <pipe.h>
+
+/*
+ * Pipes. See pipe.h.
+ *
+ * Both vnodes are embedded in struct pipe. Each end's vnode refcount
+ * counts the open files on that end, so VOP_RECLAIM of an end means
+ * the last descriptor for it has gone: the other end is woken to see
+ * EOF or EPIPE, and whichever end goes second frees the pipe.
+ */
+
+struct pipe {
+    char *p_pages[PIPE_NPAGES]; // the ring, one page at a time
+    unsigned p_head;            // offset of the first unread byte
+    unsigned p_count;           // unread bytes
+    bool p_reader;              // read end still open
+    bool p_writer;              // write end still open
+    struct lock *p_lock;        // for all of the above
+    struct cv *p_readcv;        // readers waiting for data
+    struct cv *p_writecv;       // writers waiting for space
+    struct pollqueue p_pollq;   // pollers of either end
+    struct vnode p_readvn;
+    struct vnode p_writevn;
+};
+
+static void pipe_freepages(struct pipe *pp) {
+    unsigned i;
+
+    for(i = 0; i < PIPE_NPAGES; i++) {
+        kfree(pp->p_pages[i]);
+    }
+}
+
+static void pipe_destroy(struct pipe *pp) {
+    pollqueue_cleanup(&pp->p_pollq);
+    pipe_freepages(pp);
+    cv_destroy(pp->p_writecv);
+    cv_destroy(pp->p_readcv);
+    lock_destroy(pp->p_lock);
+    kfree(pp);
+}
+
+/*
+ * Move len bytes between the ring, starting at offset start, and the
+ * uio, one uiomove per page, wrapping round the end of the ring if
+ * need be.
+ */
+static int pipe_move(struct pipe *pp, unsigned start, size_t len,
+                     struct uio *uio) {
+    size_t span;
+    unsigned off;
+    int result = 0;
+
+    while(len > 0 && result == 0) {
+        off = start % PIPE_SIZE;
+        span = PAGE_SIZE - off % PAGE_SIZE;
+        if(span > len) {
+            span = len;
+        }
+        result = uiomove(pp->p_pages[off / PAGE_SIZE] + off % PAGE_SIZE,
+                         span, uio);
+        start += span;
+        len -= span;
+    }
+    return result;
+}
+
+static int pipe_eachopen(struct vnode *vn, int flags) {
+    (void)vn;
+    (void)flags;
+    return 0;
+}
+
+static int pipe_reclaim(struct vnode *vn) {
+    struct pipe *pp = vn->vn_data;
+    bool gone;
+
+    lock_acquire(pp->p_lock);
+    if(vn == &pp->p_readvn) {
+        pp->p_reader = false;
+    } else {
+        pp->p_writer = false;
+    }
+    vnode_cleanup(vn);
+    cv_broadcast(pp->p_readcv, pp->p_lock);
+    cv_broadcast(pp->p_writecv, pp->p_lock);
+    pollqueue_wakeup(&pp->p_pollq);
+    gone = !pp->p_reader && !pp->p_writer;
+    lock_release(pp->p_lock);
+
+    // only the second end to go sees both flags clear
+    if(gone) {
+        pipe_destroy(pp);
+    }
+    return 0;
+}
+
+static int pipe_read(struct vnode *vn, struct uio *uio) {
+    struct pipe *pp = vn->vn_data;
+    size_t len, resid;
+    int result;
+
+    if(vn != &pp->p_readvn) {
+        return EBADF;
+    }
+    // nothing asked for, so nothing to wait for
+    if(uio->uio_resid == 0) {
+        return 0;
+    }
+
+    lock_acquire(pp->p_lock);
+    while(pp->p_count == 0 && pp->p_writer) {
+        cv_wait(pp->p_readcv, pp->p_lock);
+    }
+    // return what's there; with no writer left, zero bytes is EOF
+    len = uio->uio_resid < pp->p_count ? uio->uio_resid : pp->p_count;
+    resid = uio->uio_resid;
+    result = pipe_move(pp, pp->p_head, len, uio);
+    len = resid - uio->uio_resid;
+    pp->p_head = (pp->p_head + len) % PIPE_SIZE;
+    pp->p_count -= len;
+    if(len > 0) {
+        cv_broadcast(pp->p_writecv, pp->p_lock);
+        pollqueue_wakeup(&pp->p_pollq);
+    }
+    lock_release(pp->p_lock);
+    return result;
+}
+
+static int pipe_write(struct vnode *vn, struct uio *uio) {
+    struct pipe *pp = vn->vn_data;
+    size_t len, resid, want;
+    int result = 0;
+
+    if(vn != &pp->p_writevn) {
+        return EBADF;
+    }
+
+    // small writes wait for room for all of it, so they stay in one piece
+    want = uio->uio_resid <= PIPE_BUF ? uio->uio_resid : 1;
+
+    lock_acquire(pp->p_lock);
+    while(uio->uio_resid > 0) {
+        if(!pp->p_reader) {
+            result = EPIPE;
+            break;
+        }
+        len = PIPE_SIZE - pp->p_count;
+        if(len < want) {
+            cv_wait(pp->p_writecv, pp->p_lock);
+            continue;
+        }
+        if(len > uio->uio_resid) {
+            len = uio->uio_resid;
+        }
+        resid = uio->uio_resid;
+        result = pipe_move(pp, pp->p_head + pp->p_count, len, uio);
+        pp->p_count += resid - uio->uio_resid;
+        if(resid > uio->uio_resid) {
+            cv_broadcast(pp->p_readcv, pp->p_lock);
+            pollqueue_wakeup(&pp->p_pollq);
+        }
+        if(result) {
+            break;
+        }
+    }
+    lock_release(pp->p_lock);
+    return result;
+}
+
+static int pipe_ioctl(struct vnode *vn, int op, userptr_t data) {
+    (void)vn;
+    (void)op;
+    (void)data;
+    return EINVAL;
+}
+
+static int pipe_stat(struct vnode *vn, struct stat *statbuf) {
+    struct pipe *pp = vn->vn_data;
+
+    bzero(statbuf, sizeof(struct stat));
+    statbuf->st_mode = _S_IFIFO;
+    statbuf->st_nlink = 1;
+    statbuf->st_size = pp->p_count;
+    statbuf->st_blksize = PIPE_SIZE;
+    return 0;
+}
+
+static int pipe_gettype(struct vnode *vn, mode_t *result) {
+    (void)vn;
+    *result = _S_IFIFO;
+    return 0;
+}
+
+static bool pipe_isseekable(struct vnode *vn) {
+    (void)vn;
+    return false;
+}
+
+static int pipe_fsync(struct vnode *vn) {
+    (void)vn;
+    return 0;
+}
+
+static int pipe_truncate(struct vnode *vn, off_t len) {
+    (void)vn;
+    (void)len;
+    return EINVAL;
+}
+
+/*
+ * The read end is readable with data in the ring, and hung up with no
+ * writer. The write end is writable with room for PIPE_BUF bytes (so a
+ * small write won't block), and in error with no reader.
+ */
+static int pipe_poll(struct vnode *vn, int events, struct pollwaiter *pw) {
+    struct pipe *pp = vn->vn_data;
+    int revents = 0;
+
+    lock_acquire(pp->p_lock);
+    poll_wait(pw, &pp->p_pollq);
+    if(vn == &pp->p_readvn) {
+        if(pp->p_count > 0) {
+            revents |= POLLIN | POLLRDNORM;
+        }
+        if(!pp->p_writer) {
+            revents |= POLLHUP;
+        }
+    } else {
+        if(!pp->p_reader) {
+            revents |= POLLERR;
+        } else if(PIPE_SIZE - pp->p_count >= PIPE_BUF) {
+            revents |= POLLOUT | POLLWRNORM;
+        }
+    }
+    lock_release(pp->p_lock);
+    return revents & events;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+    .vop_magic = VOP_MAGIC,
+
+    .vop_eachopen = pipe_eachopen,
+    .vop_reclaim = pipe_reclaim,
+
+    .vop_read = pipe_read,
+    .vop_readlink = vopfail_uio_inval,
+    .vop_getdirentry = vopfail_uio_notdir,
+    .vop_write = pipe_write,
+    .vop_ioctl = pipe_ioctl,
+    .vop_stat = pipe_stat,
+    .vop_gettype = pipe_gettype,
+    .vop_isseekable = pipe_isseekable,
+    .vop_fsync = pipe_fsync,
+    .vop_mmap = vopfail_mmap_perm,
+    .vop_truncate = pipe_truncate,
+    .vop_namefile = vopfail_uio_inval,
+    .vop_poll = pipe_poll,
+
+    .vop_creat = vopfail_creat_notdir,
+    .vop_symlink = vopfail_symlink_notdir,
+    .vop_mkdir = vopfail_mkdir_notdir,
+    .vop_link = vopfail_link_notdir,
+    .vop_remove = vopfail_string_notdir,
+    .vop_rmdir = vopfail_string_notdir,
+    .vop_rename = vopfail_rename_notdir,
+    .vop_lookup = vopfail_lookup_notdir,
+    .vop_lookparent = vopfail_lookparent_notdir,
+};
+
+int pipe_create(struct vnode **readvn, struct vnode **writevn) {
+    struct pipe *pp;
+    unsigned i;
+
+    pp = kmalloc(sizeof(struct pipe));
+    if(pp == NULL) {
+        return ENOMEM;
+    }
+    // single pages, as alloc_kpages hands out nothing bigger after boot
+    for(i = 0; i < PIPE_NPAGES; i++) {
+        pp->p_pages[i] = kmalloc(PAGE_SIZE);
+    }
+    pp->p_lock = lock_create("pipe");
+    pp->p_readcv = cv_create("pipe read");
+    pp->p_writecv = cv_create("pipe write");
+    if(pp->p_lock == NULL || pp->p_readcv == NULL ||
+       pp->p_writecv == NULL) {
+        goto fail;
+    }
+    for(i = 0; i < PIPE_NPAGES; i++) {
+        if(pp->p_pages[i] == NULL) {
+            goto fail;
+        }
+    }
+    if(vnode_init(&pp->p_readvn, &pipe_vnode_ops, NULL, pp)) {
+        goto fail;
+    }
+    if(vnode_init(&pp->p_writevn, &pipe_vnode_ops, NULL, pp)) {
+        vnode_cleanup(&pp->p_readvn);
+        goto fail;
+    }
+    pp->p_head = 0;
+    pp->p_count = 0;
+    pp->p_reader = true;
+    pp->p_writer = true;
+    pollqueue_init(&pp->p_pollq);
+
+    *readvn = &pp->p_readvn;
+    *writevn = &pp->p_writevn;
+    return 0;
+
+fail:
+    pipe_freepages(pp);
+    if(pp->p_writecv != NULL) {
+        cv_destroy(pp->p_writecv);
+    }
+    if(pp->p_readcv != NULL) {
+        cv_destroy(pp->p_readcv);
+    }
+    if(pp->p_lock != NULL) {
+        lock_destroy(pp->p_lock);
+    }
+    kfree(pp);
+    return ENOMEM;
+}
@@ -0,0 +1,481 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <openfile.h>
+#include <file.h>
+#include <scratch.h>
+#include <poll.h>
+
+/*
+ * poll() and select(). See poll.h.
+ */
+
+struct pollwaiter {
+    struct semaphore *pw_sem;       // V'd by every wakeup and the timeout
+    struct pollentry *pw_entries;   // our entries on the objects' queues
+    int pw_error;                   // a poll_wait couldn't queue us
+    struct timespec pw_deadline;
+    bool pw_expired;                // deadline has passed
+    struct pollwaiter *pw_next;     // on polltimers
+};
+
+struct pollentry {
+    struct pollentry *pe_next;      // on pe_queue
+    struct pollentry *pe_wnext;     // on pe_waiter's list
+    struct pollqueue *pe_queue;
+    struct pollwaiter *pe_waiter;
+};
+
+/*
+ * Waiters with a timeout. poll_timerthread checks them once a second
+ * with clocksleep, so a timeout fires at most about a second late; if
+ * hardclock calls poll_hardclock they fire on the next tick instead.
+ */
+static struct spinlock polltimer_lock = SPINLOCK_INITIALIZER;
+static struct pollwaiter *polltimers;
+static bool polltimer_started;
+
+void pollqueue_init(struct pollqueue *pq) {
+    spinlock_init(&pq->pq_lock);
+    pq->pq_entries = NULL;
+}
+
+void pollqueue_cleanup(struct pollqueue *pq) {
+    KASSERT(pq->pq_entries == NULL);
+    spinlock_cleanup(&pq->pq_lock);
+}
+
+void pollqueue_wakeup(struct pollqueue *pq) {
+    struct pollentry *pe;
+
+    spinlock_acquire(&pq->pq_lock);
+    for(pe = pq->pq_entries; pe != NULL; pe = pe->pe_next) {
+        V(pe->pe_waiter->pw_sem);
+    }
+    spinlock_release(&pq->pq_lock);
+}
+
+void poll_wait(struct pollwaiter *pw, struct pollqueue *pq) {
+    struct pollentry *pe;
+
+    if(pw == NULL) {
+        return;
+    }
+    // the entries only live until the poll returns
+    pe = scratch_alloc(sizeof(struct pollentry));
+    if(pe == NULL) {
+        pw->pw_error = ENOMEM;
+        return;
+    }
+    pe->pe_queue = pq;
+    pe->pe_waiter = pw;
+    pe->pe_wnext = pw->pw_entries;
+    pw->pw_entries = pe;
+
+    spinlock_acquire(&pq->pq_lock);
+    pe->pe_next = pq->pq_entries;
+    pq->pq_entries = pe;
+    spinlock_release(&pq->pq_lock);
+}
+
+static void poll_unqueue(struct pollwaiter *pw) {
+    struct pollentry *pe, **pep;
+    struct pollqueue *pq;
+
+    for(pe = pw->pw_entries; pe != NULL; pe = pe->pe_wnext) {
+        pq = pe->pe_queue;
+        spinlock_acquire(&pq->pq_lock);
+        for(pep = &pq->pq_entries; *pep != pe; pep = &(*pep)->pe_next) {
+            KASSERT(*pep != NULL);
+        }
+        *pep = pe->pe_next;
+        spinlock_release(&pq->pq_lock);
+    }
+    pw->pw_entries = NULL;
+}
+
+static void poll_expire(void) {
+    struct pollwaiter *pw;
+    struct timespec now;
+
+    if(polltimers == NULL) {
+        return;
+    }
+    gettime(&now);
+    spinlock_acquire(&polltimer_lock);
+    for(pw = polltimers; pw != NULL; pw = pw->pw_next) {
+        if(pw->pw_expired) {
+            continue;
+        }
+        if(now.tv_sec > pw->pw_deadline.tv_sec ||
+           (now.tv_sec == pw->pw_deadline.tv_sec &&
+            now.tv_nsec >= pw->pw_deadline.tv_nsec)) {
+            pw->pw_expired = true;
+            V(pw->pw_sem);
+        }
+    }
+    spinlock_release(&polltimer_lock);
+}
+
+void poll_hardclock(void) {
+    if(curcpu->c_number == 0) {
+        poll_expire();
+    }
+}
+
+static void poll_timerthread(void *unused1, unsigned long unused2) {
+    (void)unused1;
+    (void)unused2;
+
+    for(;;) {
+        clocksleep(1);
+        poll_expire();
+    }
+}
+
+static int poll_settimer(struct pollwaiter *pw, int timeout) {
+    struct timespec now, delta;
+    bool start;
+    int result;
+
+    // the first timed poll starts the timer thread
+    spinlock_acquire(&polltimer_lock);
+    start = !polltimer_started;
+    polltimer_started = true;
+    spinlock_release(&polltimer_lock);
+    if(start) {
+        result = thread_fork("poll timer", NULL, poll_timerthread, NULL, 0);
+        if(result) {
+            spinlock_acquire(&polltimer_lock);
+            polltimer_started = false;
+            spinlock_release(&polltimer_lock);
+            return result;
+        }
+    }
+
+    gettime(&now);
+    delta.tv_sec = timeout / 1000;
+    delta.tv_nsec = (timeout % 1000) * 1000000;
+    timespec_add(&now, &delta, &pw->pw_deadline);
+
+    spinlock_acquire(&polltimer_lock);
+    pw->pw_next = polltimers;
+    polltimers = pw;
+    spinlock_release(&polltimer_lock);
+    return 0;
+}
+
+static bool poll_cleartimer(struct pollwaiter *pw) {
+    struct pollwaiter **pwp;
+    bool expired;
+
+    spinlock_acquire(&polltimer_lock);
+    for(pwp = &polltimers; *pwp != pw; pwp = &(*pwp)->pw_next) {
+        KASSERT(*pwp != NULL);
+    }
+    *pwp = pw->pw_next;
+    expired = pw->pw_expired;
+    spinlock_release(&polltimer_lock);
+    return expired;
+}
+
+static bool poll_expired(struct pollwaiter *pw) {
+    bool expired;
+
+    spinlock_acquire(&polltimer_lock);
+    expired = pw->pw_expired;
+    spinlock_release(&polltimer_lock);
+    return expired;
+}
+
+static int poll_one(struct openfile *file, struct pollfd *pfd,
+                    struct pollwaiter *pw) {
+    struct vnode *vn;
+    int events;
+
+    if(pfd->fd < 0) {
+        return 0;
+    }
+    if(file == NULL) {
+        return POLLNVAL;
+    }
+    vn = file->of_vnode;
+    // errors and hangups are reported whether asked for or not
+    events = pfd->events | POLLERR | POLLHUP;
+    if(vn->vn_ops->vop_poll == NULL) {
+        return events & (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+    }
+    return VOP_POLL(vn, events, pw) & events;
+}
+
+/*
+ * Fill in revents for the nfds entries of fds, waiting up to timeout
+ * milliseconds (forever if negative) for at least one to have any, and
+ * hand back how many have.
+ */
+static int poll_fds(struct pollfd *fds, unsigned nfds, int timeout,
+                    int *nready) {
+    struct openfile **files;
+    struct pollwaiter pw, *waiter;
+    unsigned i;
+    int n, result = 0;
+
+    files = scratch_alloc(nfds * sizeof(struct openfile *));
+    if(files == NULL) {
+        return ENOMEM;
+    }
+    // hold the files open so the objects and their queues stay put
+    for(i = 0; i < nfds; i++) {
+        files[i] = NULL;
+        if(fds[i].fd >= 0) {
+            files[i] = fdtable_get(curthread->fdtable, fds[i].fd);
+        }
+        if(files[i] != NULL) {
+            openfile_incref(files[i]);
+        }
+    }
+
+    pw.pw_sem = NULL;
+    pw.pw_entries = NULL;
+    pw.pw_error = 0;
+    pw.pw_expired = false;
+    if(timeout != 0) {
+        pw.pw_sem = sem_create("poll", 0);
+        if(pw.pw_sem == NULL) {
+            result = ENOMEM;
+            goto out;
+        }
+        if(timeout > 0) {
+            result = poll_settimer(&pw, timeout);
+            if(result) {
+                sem_destroy(pw.pw_sem);
+                goto out;
+            }
+        }
+    }
+
+    // only the first pass joins the queues; they stay joined until the end
+    waiter = (timeout != 0) ? &pw : NULL;
+    for(;;) {
+        n = 0;
+        for(i = 0; i < nfds; i++) {
+            fds[i].revents = poll_one(files[i], &fds[i], waiter);
+            if(fds[i].revents) {
+                n++;
+            }
+        }
+        waiter = NULL;
+        if(pw.pw_error) {
+            result = pw.pw_error;
+            break;
+        }
+        if(n > 0 || timeout == 0 || (timeout > 0 && poll_expired(&pw))) {
+            break;
+        }
+        P(pw.pw_sem);
+    }
+    *nready = n;
+
+    if(timeout > 0) {
+        poll_cleartimer(&pw);
+    }
+    poll_unqueue(&pw);
+    if(pw.pw_sem != NULL) {
+        sem_destroy(pw.pw_sem);
+    }
+out:
+    for(i = 0; i < nfds; i++) {
+        if(files[i] != NULL) {
+            openfile_decref(files[i]);
+        }
+    }
+    return result;
+}
+
+static int poll_user(struct pollfd *ufds, unsigned nfds, int timeout,
+                     int *retval) {
+
+    struct pollfd *fds;
+    int result, n;
+
+    if(nfds > FDTABLE_MAX) {
+        *retval = -1;
+        return EINVAL;
+    }
+    fds = scratch_alloc(nfds * sizeof(struct pollfd));
+    if(fds == NULL) {
+        *retval = -1;
+        return ENOMEM;
+    }
+    result = copyin((const_userptr_t)ufds, fds, nfds * sizeof(struct pollfd));
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+
+    result = poll_fds(fds, nfds, timeout, &n);
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+    result = copyout(fds, (userptr_t)ufds, nfds * sizeof(struct pollfd));
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+    *retval = n;
+    return 0;
+}
+
+#define FD_ISSET_(set, fd) ((set)->fds_bits[(fd) / __NFDBITS] & \
+                            ((__u32)1 << ((fd) % __NFDBITS)))
+#define FD_SET_(set, fd)   ((set)->fds_bits[(fd) / __NFDBITS] |= \
+                            ((__u32)1 << ((fd) % __NFDBITS)))
+
+/*
+ * select is done as a poll: the three sets become one pollfd array and
+ * the results go back into the sets. Only the first nfds bits of each
+ * set are copied in and out.
+ */
+static int select_user(int nfds, struct __fd_set *readfds,
+                       struct __fd_set *writefds, struct __fd_set *exceptfds,
+                       struct timeval *utimeout, int *retval) {
+
+    struct __fd_set *usets[3] = { readfds, writefds, exceptfds };
+    static const short setevents[3] = { POLLIN, POLLOUT, POLLPRI };
+    static const short setrevents[3] = {
+        POLLIN | POLLHUP | POLLERR, POLLOUT | POLLERR, POLLPRI,
+    };
+    struct __fd_set *sets;
+    struct pollfd *fds;
+    struct timeval tv;
+    size_t setlen;
+    unsigned npoll = 0, i;
+    int fd, s, result, n, timeout = -1;
+
+    if(nfds < 0 || nfds > __FD_SETSIZE) {
+        *retval = -1;
+        return EINVAL;
+    }
+    setlen = (nfds + __NFDBITS - 1) / __NFDBITS * sizeof(__u32);
+
+    if(utimeout != NULL) {
+        result = copyin((const_userptr_t)utimeout, &tv, sizeof(tv));
+        if(result) {
+            *retval = -1;
+            return result;
+        }
+        if(tv.tv_sec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000) {
+            *retval = -1;
+            return EINVAL;
+        }
+        // round up to whole milliseconds, capped at about 24 days
+        timeout = 0x7fffffff;
+        if(tv.tv_sec < 0x7fffffff / 1000 - 1) {
+            timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        }
+    }
+
+    sets = scratch_alloc(3 * sizeof(struct __fd_set));
+    fds = scratch_alloc(nfds * sizeof(struct pollfd));
+    if(sets == NULL || fds == NULL) {
+        *retval = -1;
+        return ENOMEM;
+    }
+    bzero(sets, 3 * sizeof(struct __fd_set));
+    for(s = 0; s < 3; s++) {
+        if(usets[s] == NULL) {
+            continue;
+        }
+        result = copyin((const_userptr_t)usets[s], &sets[s], setlen);
+        if(result) {
+            *retval = -1;
+            return result;
+        }
+    }
+
+    for(fd = 0; fd < nfds; fd++) {
+        short events = 0;
+        for(s = 0; s < 3; s++) {
+            if(FD_ISSET_(&sets[s], fd)) {
+                events |= setevents[s];
+            }
+        }
+        if(events) {
+            fds[npoll].fd = fd;
+            fds[npoll].events = events;
+            npoll++;
+        }
+    }
+
+    result = poll_fds(fds, npoll, timeout, &n);
+    if(result) {
+        *retval = -1;
+        return result;
+    }
+
+    n = 0;
+    bzero(sets, 3 * sizeof(struct __fd_set));
+    for(i = 0; i < npoll; i++) {
+        if(fds[i].revents & POLLNVAL) {
+            *retval = -1;
+            return EBADF;
+        }
+        for(s = 0; s < 3; s++) {
+            if(fds[i].events & setevents[s] &&
+               fds[i].revents & setrevents[s]) {
+                FD_SET_(&sets[s], fds[i].fd);
+                n++;
+            }
+        }
+    }
+    for(s = 0; s < 3; s++) {
+        if(usets[s] == NULL) {
+            continue;
+        }
+        result = copyout(&sets[s], (userptr_t)usets[s], setlen);
+        if(result) {
+            *retval = -1;
+            return result;
+        }
+    }
+    *retval = n;
+    return 0;
+}
+
+/*
+ * Everything poll and select allocate, queue entries included, is in
+ * the scratch arena and goes when they return.
+ */
+int sys_poll(struct pollfd *ufds, unsigned nfds, int timeout, int *retval) {
+
+    struct scratchmark mark;
+    int result;
+
+    scratch_mark(&mark);
+    result = poll_user(ufds, nfds, timeout, retval);
+    scratch_release(&mark);
+    return result;
+}
+
+int sys_select(int nfds, struct __fd_set *readfds, struct __fd_set *writefds,
+               struct __fd_set *exceptfds, struct timeval *utimeout,
+               int *retval) {
+
+    struct scratchmark mark;
+    int result;
+
+    scratch_mark(&mark);
+    result = select_user(nfds, readfds, writefds, exceptfds, utimeout, retval);
+    scratch_release(&mark);
+    return result;
+}
@@ -0,0 +1,128 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <scratch.h>
+
+/*
+ * Per-thread syscall scratch arena. See scratch.h.
+ */
+
+// everything handed out is aligned to this
+#define SCRATCH_ALIGN 8
+
+// arena buffers kept for reuse
+#define SCRATCH_POOLMAX 8
+
+struct scratch_big {
+    struct scratch_big *sb_next;
+    // keeps the data after the header aligned
+    uint64_t sb_data[];
+};
+
+static struct spinlock scratch_poollock = SPINLOCK_INITIALIZER;
+static char *scratch_pool[SCRATCH_POOLMAX];
+static unsigned scratch_npool;
+
+static char *scratch_getbuf(void) {
+    char *buf = NULL;
+
+    spinlock_acquire(&scratch_poollock);
+    if(scratch_npool > 0) {
+        buf = scratch_pool[--scratch_npool];
+    }
+    spinlock_release(&scratch_poollock);
+    if(buf == NULL) {
+        buf = kmalloc(SCRATCH_SIZE);
+    }
+    return buf;
+}
+
+static void scratch_putbuf(char *buf) {
+    spinlock_acquire(&scratch_poollock);
+    if(scratch_npool < SCRATCH_POOLMAX) {
+        scratch_pool[scratch_npool++] = buf;
+        buf = NULL;
+    }
+    spinlock_release(&scratch_poollock);
+    kfree(buf);
+}
+
+void scratch_init(struct scratch *sc) {
+    sc->sc_base = NULL;
+    sc->sc_used = 0;
+    sc->sc_big = NULL;
+}
+
+void *scratch_alloc(size_t size) {
+    struct scratch *sc = &curthread->t_scratch;
+    struct scratch_big *big;
+    void *ptr;
+
+    KASSERT(!curthread->t_in_interrupt);
+
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if(size <= SCRATCH_SIZE - sc->sc_used) {
+        if(sc->sc_base == NULL) {
+            sc->sc_base = scratch_getbuf();
+            if(sc->sc_base == NULL) {
+                return NULL;
+            }
+        }
+        ptr = sc->sc_base + sc->sc_used;
+        sc->sc_used += size;
+        return ptr;
+    }
+
+    big = kmalloc(sizeof(struct scratch_big) + size);
+    if(big == NULL) {
+        return NULL;
+    }
+    big->sb_next = sc->sc_big;
+    sc->sc_big = big;
+    return big->sb_data;
+}
+
+void scratch_mark(struct scratchmark *mark) {
+    struct scratch *sc = &curthread->t_scratch;
+
+    mark->sm_used = sc->sc_used;
+    mark->sm_big = sc->sc_big;
+}
+
+static void scratch_releaseto(struct scratch *sc,
+                              const struct scratchmark *mark) {
+    struct scratch_big *big;
+
+    KASSERT(mark->sm_used <= sc->sc_used);
+    sc->sc_used = mark->sm_used;
+    // newer oversize blocks are nearer the head
+    while(sc->sc_big != mark->sm_big) {
+        big = sc->sc_big;
+        KASSERT(big != NULL);
+        sc->sc_big = big->sb_next;
+        kfree(big);
+    }
+    // nothing in use: the buffer goes back to the pool
+    if(sc->sc_used == 0 && sc->sc_base != NULL) {
+        scratch_putbuf(sc->sc_base);
+        sc->sc_base = NULL;
+    }
+}
+
+void scratch_release(const struct scratchmark *mark) {
+    scratch_releaseto(&curthread->t_scratch, mark);
+}
+
+void scratch_reset(void) {
+    struct scratchmark empty = { 0, NULL };
+
+    scratch_release(&empty);
+}
+
+void scratch_cleanup(struct scratch *sc) {
+    struct scratchmark empty = { 0, NULL };
+
+    scratch_releaseto(sc, &empty);
+}
@@ -0,0 +1,158 @@
+#include <sys/mman.h>
+#include <time.h>
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <vmstat.h>
+#include <vmtrace.h>
+#include "hostvm.h"
+
+/*
+ * Physical memory, cpus and processes for running the allocators and
+ * the fault path on the host. hostvm_bootstrap maps the arena and then
+ * runs the kernel's own vm_bootstrap on it.
+ *
+ * The per-cpu VM counters and the fault trace are not kept: vm_fault
+ * is timed by the bench itself. A TLB shootdown has no TLB to flush, so
+ * the sender runs the target's handler itself, as that cpu.
+ */
+
+vaddr_t host_kseg0;
+__thread struct cpu *curcpu;
+volatile bool vmtrace_enabled;
+
+static __thread struct addrspace *curas;
+
+static paddr_t firstfree, lastpaddr;
+static struct cpu hostcpus[VM_MAXCPUS];
+
+paddr_t
+ram_stealmem(unsigned long npages)
+{
+    paddr_t paddr;
+
+    if (firstfree + npages * PAGE_SIZE > lastpaddr) {
+        return 0;
+    }
+    paddr = firstfree;
+    firstfree += npages * PAGE_SIZE;
+    return paddr;
+}
+
+paddr_t
+ram_getsize(void)
+{
+    return lastpaddr;
+}
+
+paddr_t
+ram_getfirstfree(void)
+{
+    paddr_t ret;
+
+    ret = firstfree;
+    firstfree = lastpaddr;
+    return ret;
+}
+
+char *
+kstrdup(const char *str)
+{
+    char *ret;
+
+    ret = kmalloc(strlen(str) + 1);
+    if (ret == NULL) {
+        return NULL;
+    }
+    strcpy(ret, str);
+    return ret;
+}
+
+void
+hostvm_setcpu(unsigned cpunum)
+{
+    KASSERT(cpunum < VM_MAXCPUS);
+    hostcpus[cpunum].c_number = cpunum;
+    curcpu = &hostcpus[cpunum];
+}
+
+unsigned
+hostvm_freeframes(void)
+{
+    unsigned ret;
+
+    spinlock_acquire(&frametable_lock);
+    ret = frames_total - frames_inuse;
+    spinlock_release(&frametable_lock);
+    return ret;
+}
+
+void
+hostvm_setas(struct addrspace *as)
+{
+    curas = as;
+    as_activate();
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+    struct cpu *self = curcpu;
+
+    curcpu = target;
+    vm_tlbshootdown(mapping);
+    curcpu = self;
+}
+
+struct addrspace *
+proc_getas(void)
+{
+    return curas;
+}
+
+void
+vmstat_add(unsigned which, unsigned n)
+{
+    (void)which;
+    (void)n;
+}
+
+void
+vmtrace_record(int faulttype, vaddr_t faultaddress, struct addrspace *as,
+               int outcome, int error, const struct timespec *start,
+               const struct timespec *end)
+{
+    (void)faulttype;
+    (void)faultaddress;
+    (void)as;
+    (void)outcome;
+    (void)error;
+    (void)start;
+    (void)end;
+}
+
+void
+hostvm_bootstrap(size_t ramsize)
+{
+    void *arena;
+
+    ramsize = ramsize & PAGE_FRAME;
+    /* Low enough that kfence's kseg2 area is never in the arena. */
+    arena = mmap((void *)0x40000000, ramsize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        panic("hostvm: cannot map %zu bytes of RAM\n", ramsize);
+    }
+    host_kseg0 = (vaddr_t)arena;
+    if (host_kseg0 + ramsize > MIPS_KSEG2) {
+        panic("hostvm: RAM mapped at %p runs into kseg2\n", arena);
+    }
+    /* Physical page 0 is the "kernel image", as 0 means no frame. */
+    firstfree = PAGE_SIZE;
+    lastpaddr = ramsize;
+
+    vm_bootstrap();
+}
@@ -0,0 +1,26 @@
+#ifndef _HOSTVM_H_
+#define _HOSTVM_H_
+
+/*
+ * The bits of the kernel that the allocators and the fault path need,
+ * on the host.
+ *
+ *    hostvm_bootstrap - map an arena of ramsize bytes as physical
+ *                       memory, then run vm_bootstrap on it.
+ *    hostvm_setcpu    - make the calling thread cpu number cpunum.
+ *    hostvm_setas     - make as the address space of the calling
+ *                       thread's process, as seen by proc_getas, and
+ *                       activate it.
+ *    hostvm_freeframes - frames currently free in the frame table.
+ */
+
+#include <types.h>
+
+struct addrspace;
+
+void hostvm_bootstrap(size_t ramsize);
+void hostvm_setcpu(unsigned cpunum);
+void hostvm_setas(struct addrspace *as);
+unsigned hostvm_freeframes(void);
+
+#endif /* _HOSTVM_H_ */
@@ -0,0 +1,746 @@
+/*
+ * kbench - run kmalloc.c and frametable.c on the host and time them.
+ *
+ * Each thread is a cpu of its own and runs a list of operations on its
+ * own array of slots:
+ *
+ *    a SLOT SIZE   kmalloc(SIZE) into SLOT
+ *    f SLOT        kfree SLOT
+ *    p SLOT        alloc_kpages(1) into SLOT
+ *    q SLOT        free_kpages SLOT
+ *
+ * The list is either made up (-w) or read from a trace file (-r) in
+ * exactly that format, one operation per line, # for comments. -o
+ * writes the list of the first thread out as such a trace. Every
+ * thread replays the whole trace. A trace recorded elsewhere only
+ * needs converting to this format; slot numbers can be anything below
+ * 2^24.
+ *
+ * Each operation is timed on its own, so the latencies include the
+ * cost of reading the clock (some tens of ns). Blocks are stamped on
+ * allocation and checked on free, so a broken allocator shows up as
+ * "corrupt block" and not as good numbers. kfence cannot be used, as
+ * nothing maps its pages on the host.
+ *
+ * The faults workload is different: each thread is a process with an
+ * address space of one region of SLOTS pages, which it faults in page
+ * by page with write faults through vm_fault. Once every page is
+ * mapped the process exits (as_destroy) and a new one starts, until
+ * OPS faults have been taken. There is no TLB on the host, so every
+ * fault goes the whole way: frame allocation, zeroing and the page
+ * table insert under the address space's lock. The latencies are
+ * reported as "fault" and "exit".
+ *
+ * With more than one thread (-t) the throughput of each thread, that
+ * is each cpu, is printed under the total, which is all operations
+ * over the time of the slowest thread.
+ *
+ * Fragmentation is sampled by the first thread every FRAG_INTERVAL
+ * operations: the bytes asked for that are still allocated, over the
+ * memory taken out of the frame table for them. The peak is the sample
+ * with the most frames in use.
+ */
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <elf.h>
+#include "hostvm.h"
+
+#define OP_ALLOC  0
+#define OP_FREE   1
+#define OP_PALLOC 2
+#define OP_PFREE  3
+
+#define MAXSLOTS      (1U << 24)
+#define FRAG_INTERVAL 1024
+#define FAULT_BASE    0x00400000    /* where the faults region starts */
+
+struct op {
+    uint8_t op_kind;
+    uint32_t op_slot;
+    uint32_t op_size;
+};
+
+struct slot {
+    void *s_ptr;
+    uint32_t s_size;
+    bool s_page;        /* from alloc_kpages, not kmalloc */
+};
+
+struct worker {
+    pthread_t w_thread;
+    unsigned w_cpu;
+    struct op *w_ops;
+    unsigned w_nops;
+    struct slot *w_slots;
+    unsigned w_nslots;
+
+    /* results */
+    uint32_t *w_alloclat, *w_freelat;
+    unsigned w_nalloc, w_nfree;
+    unsigned w_failed;
+    volatile size_t w_livebytes;
+    double w_seconds;
+};
+
+static struct worker *workers;
+static unsigned nworkers;
+static bool faults;
+static unsigned frames_base;
+static pthread_barrier_t startline;
+
+/* Fragmentation samples, only written by worker 0. */
+static unsigned frag_nsamples, frag_peakframes;
+static size_t frag_peaklive;
+static double frag_utilsum;
+
+////////////////////////////////////////////////////////////
+// Workloads
+
+static unsigned rngstate;
+
+static
+unsigned
+rng(void)
+{
+    /* xorshift32 */
+    rngstate ^= rngstate << 13;
+    rngstate ^= rngstate >> 17;
+    rngstate ^= rngstate << 5;
+    return rngstate;
+}
+
+static
+uint32_t
+size_small(void)
+{
+    return 1 + rng() % 256;
+}
+
+/*
+ * Mostly small, like the kernel's own requests, with some up to a
+ * page.
+ */
+static
+uint32_t
+size_mixed(void)
+{
+    unsigned r = rng() % 100;
+
+    if (r < 60) {
+        return 1 + rng() % 64;
+    }
+    if (r < 85) {
+        return 65 + rng() % 448;
+    }
+    if (r < 97) {
+        return 513 + rng() % 1536;
+    }
+    return 2049 + rng() % 2048;
+}
+
+static
+void
+addop(struct op *ops, unsigned *nops, int kind, uint32_t slot, uint32_t size)
+{
+    ops[*nops].op_kind = kind;
+    ops[*nops].op_slot = slot;
+    ops[*nops].op_size = size;
+    (*nops)++;
+}
+
+/*
+ * Make NOPS operations of workload NAME over NSLOTS slots.
+ *    small - random slots, 1-256 bytes; about half the slots in use
+ *    mixed - the same with size_mixed
+ *    phase - fill all the slots, free 90% of them at random, repeat
+ *    pages - random slots, single frames from alloc_kpages
+ *    stress - kmallocstress's pattern: each kmalloc frees the block
+ *             from two allocations back, so only three slots are used
+ */
+static
+struct op *
+makeops(const char *name, unsigned nops, unsigned nslots)
+{
+    struct op *ops;
+    bool *used;
+    unsigned n = 0, slot, cycle = 0;
+    uint32_t (*sizefn)(void) = size_mixed;
+    bool pages = false, phase = false, stress = false;
+
+    if (!strcmp(name, "small")) {
+        sizefn = size_small;
+    }
+    else if (!strcmp(name, "pages")) {
+        pages = true;
+    }
+    else if (!strcmp(name, "phase")) {
+        phase = true;
+    }
+    else if (!strcmp(name, "stress")) {
+        stress = true;
+        if (nslots < 3) {
+            fprintf(stderr, "kbench: stress needs 3 slots\n");
+            exit(1);
+        }
+    }
+    else if (strcmp(name, "mixed")) {
+        fprintf(stderr, "kbench: unknown workload %s\n", name);
+        exit(1);
+    }
+
+    ops = malloc(nops * sizeof(*ops));
+    used = calloc(nslots, sizeof(*used));
+    if (ops == NULL || used == NULL) {
+        fprintf(stderr, "kbench: out of memory\n");
+        exit(1);
+    }
+
+    while (n < nops) {
+        if (phase) {
+            for (slot = 0; slot < nslots && n < nops; slot++) {
+                if (!used[slot]) {
+                    addop(ops, &n, OP_ALLOC, slot, sizefn());
+                    used[slot] = true;
+                }
+            }
+            for (slot = 0; slot < nslots && n < nops; slot++) {
+                if (used[slot] && rng() % 10 != 0) {
+                    addop(ops, &n, OP_FREE, slot, 0);
+                    used[slot] = false;
+                }
+            }
+            continue;
+        }
+        if (stress) {
+            slot = cycle++ % 3;
+            if (used[slot]) {
+                addop(ops, &n, OP_FREE, slot, 0);
+            }
+            if (n < nops) {
+                addop(ops, &n, OP_ALLOC, slot, sizefn());
+                used[slot] = true;
+            }
+            continue;
+        }
+        slot = rng() % nslots;
+        if (used[slot]) {
+            addop(ops, &n, pages ? OP_PFREE : OP_FREE, slot, 0);
+        }
+        else {
+            addop(ops, &n, pages ? OP_PALLOC : OP_ALLOC, slot,
+                  pages ? PAGE_SIZE : sizefn());
+        }
+        used[slot] = !used[slot];
+    }
+    free(used);
+    return ops;
+}
+
+static
+struct op *
+readtrace(const char *path, unsigned *nopsret, unsigned *nslotsret)
+{
+    FILE *f;
+    char line[128], kind;
+    unsigned long slot, size;
+    unsigned n = 0, max = 1024, nslots = 0, lineno = 0;
+    struct op *ops;
+    int nf;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    ops = malloc(max * sizeof(*ops));
+    while (ops != NULL && fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        size = 0;
+        nf = sscanf(line, " %c %lu %lu", &kind, &slot, &size);
+        if (nf < 2 || slot >= MAXSLOTS || strchr("afpq", kind) == NULL ||
+            (kind == 'a' && (nf != 3 || size == 0))) {
+            fprintf(stderr, "%s:%u: bad line\n", path, lineno);
+            exit(1);
+        }
+        if (n == max) {
+            max *= 2;
+            ops = realloc(ops, max * sizeof(*ops));
+            if (ops == NULL) {
+                break;
+            }
+        }
+        addop(ops, &n, strchr("afpq", kind) - "afpq", slot,
+              kind == 'p' ? PAGE_SIZE : size);
+        if (slot >= nslots) {
+            nslots = slot + 1;
+        }
+    }
+    if (ops == NULL) {
+        fprintf(stderr, "kbench: out of memory\n");
+        exit(1);
+    }
+    fclose(f);
+    *nopsret = n;
+    *nslotsret = nslots;
+    return ops;
+}
+
+static
+void
+writetrace(const char *path, const struct op *ops, unsigned nops)
+{
+    FILE *f;
+    unsigned i;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(f, "# kbench trace, %u operations\n", nops);
+    for (i = 0; i < nops; i++) {
+        if (ops[i].op_kind == OP_ALLOC) {
+            fprintf(f, "a %u %u\n", ops[i].op_slot, ops[i].op_size);
+        }
+        else {
+            fprintf(f, "%c %u\n", "afpq"[ops[i].op_kind], ops[i].op_slot);
+        }
+    }
+    fclose(f);
+}
+
+////////////////////////////////////////////////////////////
+// Running
+
+static inline
+uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+void
+fragsample(void)
+{
+    unsigned i, frames;
+    size_t live = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        live += workers[i].w_livebytes;
+    }
+    /* Racy read, but it's only a sample. */
+    frames = frames_inuse - frames_base;
+    if (frames == 0) {
+        return;
+    }
+    frag_nsamples++;
+    frag_utilsum += (double)live / ((double)frames * PAGE_SIZE);
+    if (frames > frag_peakframes) {
+        frag_peakframes = frames;
+        frag_peaklive = live;
+    }
+}
+
+static
+void
+stamp(struct slot *s, unsigned slot)
+{
+    if (s->s_size >= sizeof(uint32_t)) {
+        *(uint32_t *)s->s_ptr = slot;
+    }
+}
+
+static
+void
+check(struct slot *s, unsigned slot)
+{
+    if (s->s_size >= sizeof(uint32_t) && *(uint32_t *)s->s_ptr != slot) {
+        panic("kbench: corrupt block %p in slot %u\n", s->s_ptr, slot);
+    }
+}
+
+static
+void
+runops(struct worker *w)
+{
+    struct slot *s;
+    const struct op *op;
+    uint64_t t0, t1;
+    unsigned i;
+
+    for (i = 0; i < w->w_nops; i++) {
+        op = &w->w_ops[i];
+        s = &w->w_slots[op->op_slot];
+        switch (op->op_kind) {
+            case OP_ALLOC:
+            case OP_PALLOC:
+                if (s->s_ptr != NULL) {
+                    /* A trace that doesn't match up; skip it. */
+                    continue;
+                }
+                t0 = now_ns();
+                s->s_ptr = (op->op_kind == OP_ALLOC) ?
+                    kmalloc(op->op_size) : (void *)alloc_kpages(1);
+                t1 = now_ns();
+                w->w_alloclat[w->w_nalloc++] = t1 - t0;
+                if (s->s_ptr == NULL) {
+                    w->w_failed++;
+                    break;
+                }
+                s->s_size = op->op_size;
+                s->s_page = (op->op_kind == OP_PALLOC);
+                w->w_livebytes += s->s_size;
+                stamp(s, op->op_slot);
+                break;
+            case OP_FREE:
+            case OP_PFREE:
+                if (s->s_ptr == NULL) {
+                    continue;
+                }
+                check(s, op->op_slot);
+                t0 = now_ns();
+                if (op->op_kind == OP_FREE) {
+                    kfree(s->s_ptr);
+                }
+                else {
+                    free_kpages((vaddr_t)s->s_ptr);
+                }
+                t1 = now_ns();
+                w->w_freelat[w->w_nfree++] = t1 - t0;
+                w->w_livebytes -= s->s_size;
+                s->s_ptr = NULL;
+                break;
+        }
+        if (w->w_cpu == 0 && i % FRAG_INTERVAL == 0) {
+            fragsample();
+        }
+    }
+}
+
+static
+struct addrspace *
+faults_newas(unsigned npages)
+{
+    struct addrspace *as;
+
+    as = as_create();
+    if (as == NULL ||
+        as_define_region(as, FAULT_BASE, npages * PAGE_SIZE,
+                         PF_R, PF_W, 0) != 0) {
+        panic("kbench: cannot make an address space\n");
+    }
+    hostvm_setas(as);
+    return as;
+}
+
+static
+void
+faults_exit(struct addrspace *as)
+{
+    hostvm_setas(NULL);
+    as_destroy(as);
+}
+
+static
+void
+runfaults(struct worker *w)
+{
+    struct addrspace *as = NULL;
+    uint64_t t0, t1;
+    unsigned i, page = 0;
+    int result;
+
+    for (i = 0; i < w->w_nops; i++) {
+        if (as == NULL) {
+            as = faults_newas(w->w_nslots);
+            page = 0;
+        }
+        t0 = now_ns();
+        result = vm_fault(VM_FAULT_WRITE, FAULT_BASE + page * PAGE_SIZE);
+        t1 = now_ns();
+        w->w_alloclat[w->w_nalloc++] = t1 - t0;
+        if (result) {
+            w->w_failed++;
+        }
+        if (++page == w->w_nslots) {
+            t0 = now_ns();
+            faults_exit(as);
+            t1 = now_ns();
+            w->w_freelat[w->w_nfree++] = t1 - t0;
+            as = NULL;
+        }
+    }
+    if (as != NULL) {
+        faults_exit(as);
+    }
+}
+
+static
+void *
+runworker(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t start;
+
+    hostvm_setcpu(w->w_cpu);
+    pthread_barrier_wait(&startline);
+    start = now_ns();
+    if (faults) {
+        runfaults(w);
+    }
+    else {
+        runops(w);
+    }
+    w->w_seconds = (now_ns() - start) / 1e9;
+    return NULL;
+}
+
+/*
+ * Free what the workers left allocated. Done in the cpu of each
+ * worker, so that the blocks go back through that cpu's caches.
+ */
+static
+void
+cleanup(void)
+{
+    struct worker *w;
+    struct slot *s;
+    unsigned i, j;
+
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        hostvm_setcpu(w->w_cpu);
+        for (j = 0; j < w->w_nslots; j++) {
+            s = &w->w_slots[j];
+            if (s->s_ptr == NULL) {
+                continue;
+            }
+            check(s, j);
+            if (s->s_page) {
+                free_kpages((vaddr_t)s->s_ptr);
+            }
+            else {
+                kfree(s->s_ptr);
+            }
+            s->s_ptr = NULL;
+        }
+        kheap_reclaim();
+    }
+    hostvm_setcpu(0);
+}
+
+////////////////////////////////////////////////////////////
+// Reporting
+
+static
+int
+cmp32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static
+void
+latreport(const char *what, unsigned which)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9 };
+    uint32_t *all;
+    unsigned i, n = 0, k;
+    struct worker *w;
+    double sum = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        n += which ? workers[i].w_nfree : workers[i].w_nalloc;
+    }
+    if (n == 0) {
+        return;
+    }
+    all = malloc(n * sizeof(*all));
+    if (all == NULL) {
+        fprintf(stderr, "kbench: out of memory\n");
+        exit(1);
+    }
+    n = 0;
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        memcpy(all + n, which ? w->w_freelat : w->w_alloclat,
+               (which ? w->w_nfree : w->w_nalloc) * sizeof(*all));
+        n += which ? w->w_nfree : w->w_nalloc;
+    }
+    qsort(all, n, sizeof(*all), cmp32);
+    for (i = 0; i < n; i++) {
+        sum += all[i];
+    }
+
+    printf("%-6s %10u %8.1f", what, n, sum / n);
+    for (i = 0; i < ARRAYCOUNT(pcts); i++) {
+        k = (unsigned)(pcts[i] / 100 * (n - 1));
+        printf(" %8u", all[k]);
+    }
+    printf(" %8u\n", all[n - 1]);
+    free(all);
+}
+
+static
+void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: kbench [-t threads] [-n ops] [-l slots] [-s seed]\n"
+            "              [-m ram-MB] [-v]\n"
+            "              [-w small|mixed|phase|pages|stress | -r trace]"
+            " [-o trace]\n"
+            "       kbench -w faults [-t threads] [-n faults] [-l pages]"
+            " [-m ram-MB]\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *workload = "mixed", *inpath = NULL, *outpath = NULL;
+    unsigned nops = 1000000, nslots = 4096, ramsize = 64, seed = 1;
+    unsigned i, nalloc = 0, nfree = 0, failed = 0;
+    bool verbose = false;
+    struct op *ops = NULL;
+    struct worker *w;
+    double seconds = 0;
+    int ch;
+
+    nworkers = 1;
+    while ((ch = getopt(argc, argv, "t:n:l:s:m:w:r:o:v")) != -1) {
+        switch (ch) {
+            case 't': nworkers = atoi(optarg); break;
+            case 'n': nops = atoi(optarg); break;
+            case 'l': nslots = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 'm': ramsize = atoi(optarg); break;
+            case 'w': workload = optarg; break;
+            case 'r': inpath = optarg; break;
+            case 'o': outpath = optarg; break;
+            case 'v': verbose = true; break;
+            default: usage();
+        }
+    }
+    if (optind != argc || nworkers == 0 || nworkers > VM_MAXCPUS ||
+        nslots == 0 || nslots > MAXSLOTS || ramsize == 0) {
+        usage();
+    }
+
+    faults = (inpath == NULL && !strcmp(workload, "faults"));
+    if (faults && outpath != NULL) {
+        usage();
+    }
+
+    hostvm_bootstrap((size_t)ramsize * 1024 * 1024);
+    hostvm_setcpu(0);
+    frames_base = frames_inuse;
+
+    if (inpath != NULL) {
+        ops = readtrace(inpath, &nops, &nslots);
+        workload = inpath;
+    }
+
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "kbench: out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        w->w_cpu = i;
+        if (inpath != NULL) {
+            w->w_ops = ops;
+        }
+        else if (!faults) {
+            rngstate = seed * 2654435761U + i + 1;
+            w->w_ops = makeops(workload, nops, nslots);
+        }
+        w->w_nops = nops;
+        w->w_nslots = nslots;
+        w->w_slots = calloc(nslots, sizeof(*w->w_slots));
+        w->w_alloclat = malloc(nops * sizeof(uint32_t));
+        w->w_freelat = malloc(nops * sizeof(uint32_t));
+        if (w->w_slots == NULL || w->w_alloclat == NULL ||
+            w->w_freelat == NULL) {
+            fprintf(stderr, "kbench: out of memory\n");
+            exit(1);
+        }
+    }
+    if (outpath != NULL) {
+        writetrace(outpath, workers[0].w_ops, nops);
+    }
+
+    pthread_barrier_init(&startline, NULL, nworkers);
+    for (i = 0; i < nworkers; i++) {
+        pthread_create(&workers[i].w_thread, NULL, runworker, &workers[i]);
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].w_thread, NULL);
+        nalloc += workers[i].w_nalloc;
+        nfree += workers[i].w_nfree;
+        failed += workers[i].w_failed;
+        if (workers[i].w_seconds > seconds) {
+            seconds = workers[i].w_seconds;
+        }
+    }
+
+    printf("workload %s: %u threads x %u ops, %u %s, %u MB RAM\n",
+           workload, nworkers, nops, nslots,
+           faults ? "pages per process" : "slots", ramsize);
+    if (faults) {
+        printf("throughput: %.0f faults/s (%u faults, %u exits,"
+               " %u failed) in %.3f s\n", nalloc / seconds, nalloc, nfree,
+               failed, seconds);
+    }
+    else {
+        printf("throughput: %.0f ops/s (%u allocs, %u frees, %u failed)"
+               " in %.3f s\n", (nalloc + nfree) / seconds, nalloc, nfree,
+               failed, seconds);
+    }
+    if (nworkers > 1) {
+        for (i = 0; i < nworkers; i++) {
+            w = &workers[i];
+            printf("  cpu %-3u %10.0f %s/s in %.3f s\n", w->w_cpu,
+                   (faults ? w->w_nalloc : w->w_nalloc + w->w_nfree) /
+                   w->w_seconds, faults ? "faults" : "ops", w->w_seconds);
+        }
+    }
+    printf("\n%-6s %10s %8s %8s %8s %8s %8s %8s   (ns)\n", "", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    latreport(faults ? "fault" : "alloc", 0);
+    latreport(faults ? "exit" : "free", 1);
+
+    if (frag_nsamples > 0) {
+        printf("\nfragmentation: mean utilization %.1f%%; at peak %u frames"
+               " held %zu bytes, %.1f%% utilization\n",
+               100 * frag_utilsum / frag_nsamples, frag_peakframes,
+               frag_peaklive, 100.0 * frag_peaklive /
+               ((double)frag_peakframes * PAGE_SIZE));
+    }
+    if (verbose) {
+        printf("\n");
+        kheap_printstats();
+    }
+
+    cleanup();
+    printf("after freeing everything: %d frames not returned\n",
+           (int)(frames_inuse - frames_base));
+    return 0;
+}
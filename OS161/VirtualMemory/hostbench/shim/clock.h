@@ -0,0 +1,12 @@
+#ifndef _HOSTBENCH_CLOCK_H_
+#define _HOSTBENCH_CLOCK_H_
+
+#include <time.h>
+
+static inline void
+gettime(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+#endif /* _HOSTBENCH_CLOCK_H_ */
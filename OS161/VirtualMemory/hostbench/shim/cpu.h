@@ -0,0 +1,14 @@
+#ifndef _HOSTBENCH_CPU_H_
+#define _HOSTBENCH_CPU_H_
+
+/* Only what the allocators and the VM system look at. */
+struct cpu {
+    unsigned c_number;
+};
+
+struct tlbshootdown;
+
+/* Runs the target's handler at once, see hostvm.c. */
+void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+
+#endif /* _HOSTBENCH_CPU_H_ */
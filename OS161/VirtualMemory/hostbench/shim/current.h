@@ -0,0 +1,8 @@
+#ifndef _HOSTBENCH_CURRENT_H_
+#define _HOSTBENCH_CURRENT_H_
+
+/* Each bench thread sets its own cpu; see hostvm_setcpu. */
+extern __thread struct cpu *curcpu;
+#define CURCPU_EXISTS() (curcpu != NULL)
+
+#endif /* _HOSTBENCH_CURRENT_H_ */
@@ -0,0 +1,7 @@
+#ifndef _HOSTBENCH_KERN_ERRNO_H_
+#define _HOSTBENCH_KERN_ERRNO_H_
+
+/* The host's values are as good as the kernel's here. */
+#include <errno.h>
+
+#endif /* _HOSTBENCH_KERN_ERRNO_H_ */
@@ -0,0 +1,42 @@
+#ifndef _HOSTBENCH_LIB_H_
+#define _HOSTBENCH_LIB_H_
+
+/*
+ * The parts of the kernel's lib.h the allocators use, on top of libc.
+ * Keep the kheap prototypes in step with include/lib.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kprintf printf
+#define panic(...) do { printf(__VA_ARGS__); abort(); } while (0)
+#define KASSERT(expr) \
+    do { \
+        if (!(expr)) { \
+            panic("Assertion failed: %s, at %s:%d\n", \
+                  #expr, __FILE__, __LINE__); \
+        } \
+    } while (0)
+
+#define ARRAYCOUNT(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define DIVROUNDUP(a, b) (((a) + (b) - 1) / (b))
+#define ROUNDUP(a, b) (DIVROUNDUP(a, b) * (b))
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+void kheap_printstats(void);
+void kheap_nextgeneration(void);
+void kheap_dump(void);
+void kheap_dumpall(void);
+unsigned kheap_pagesinuse(void);
+unsigned kheap_reclaim(void);
+void kheap_bootstrap(void);
+void kheap_profile(unsigned rate);
+void kheap_profile_report(unsigned n);
+int kheap_profile_menu(int nargs, char **args);
+
+char *kstrdup(const char *str);
+
+#endif /* _HOSTBENCH_LIB_H_ */
@@ -0,0 +1,4 @@
+#ifndef _HOSTBENCH_MACHINE_ELF_H_
+#define _HOSTBENCH_MACHINE_ELF_H_
+/* Only the PF_ flags of elf.h are used, for region permissions. */
+#endif /* _HOSTBENCH_MACHINE_ELF_H_ */
@@ -0,0 +1,48 @@
+#ifndef _HOSTBENCH_MACHINE_TLB_H_
+#define _HOSTBENCH_MACHINE_TLB_H_
+
+/*
+ * There is no TLB: every probe misses and nothing is kept, so on the
+ * host each access the bench makes to a user page is a fault, and
+ * kfence's pages are never mapped.
+ */
+
+#include <types.h>
+
+#define TLBHI_INVALID(entryno) ((0x80000U + (entryno)) << 12)
+#define TLBLO_INVALID()        (0)
+#define TLBLO_DIRTY            0x00000400
+#define TLBLO_VALID            0x00000200
+#define NUM_TLB                64
+
+static inline int
+tlb_probe(uint32_t entryhi, uint32_t entrylo)
+{
+    (void)entryhi;
+    (void)entrylo;
+    return -1;
+}
+
+static inline void
+tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index)
+{
+    (void)entryhi;
+    (void)entrylo;
+    (void)index;
+}
+
+static inline void
+tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index)
+{
+    *entryhi = TLBHI_INVALID(index);
+    *entrylo = TLBLO_INVALID();
+}
+
+static inline void
+tlb_random(uint32_t entryhi, uint32_t entrylo)
+{
+    (void)entryhi;
+    (void)entrylo;
+}
+
+#endif /* _HOSTBENCH_MACHINE_TLB_H_ */
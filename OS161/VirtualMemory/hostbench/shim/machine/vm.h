@@ -0,0 +1,34 @@
+#ifndef _HOSTBENCH_MACHINE_VM_H_
+#define _HOSTBENCH_MACHINE_VM_H_
+
+/*
+ * "Physical memory" is an mmap'd arena set up by hostvm_bootstrap;
+ * kseg0 is wherever it ended up. Physical address 0 is the start of
+ * the arena. kseg2 (where kfence lives) is an address the arena is
+ * never at.
+ */
+
+#include <types.h>
+
+#define PAGE_SIZE  4096
+#define PAGE_FRAME (~(vaddr_t)(PAGE_SIZE - 1))
+
+extern vaddr_t host_kseg0;
+
+#define MIPS_KSEG0 host_kseg0
+#define MIPS_KSEG2 ((vaddr_t)0xc0000000)
+
+#define USERSTACK  ((vaddr_t)0x80000000)
+
+#define PADDR_TO_KVADDR(paddr) ((paddr) + MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr) - MIPS_KSEG0)
+
+struct tlbshootdown {
+    int ts_placeholder;
+};
+
+paddr_t ram_stealmem(unsigned long npages);
+paddr_t ram_getsize(void);
+paddr_t ram_getfirstfree(void);
+
+#endif /* _HOSTBENCH_MACHINE_VM_H_ */
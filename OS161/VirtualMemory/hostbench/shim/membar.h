@@ -0,0 +1,10 @@
+#ifndef _HOSTBENCH_MEMBAR_H_
+#define _HOSTBENCH_MEMBAR_H_
+
+static inline void membar_any_any(void) { __sync_synchronize(); }
+static inline void membar_store_store(void) { __sync_synchronize(); }
+static inline void membar_load_load(void) { __sync_synchronize(); }
+static inline void membar_store_any(void) { __sync_synchronize(); }
+static inline void membar_any_store(void) { __sync_synchronize(); }
+
+#endif /* _HOSTBENCH_MEMBAR_H_ */
@@ -0,0 +1,4 @@
+#ifndef _HOSTBENCH_OPT_DUMBVM_H_
+#define _HOSTBENCH_OPT_DUMBVM_H_
+#define OPT_DUMBVM 0
+#endif /* _HOSTBENCH_OPT_DUMBVM_H_ */
@@ -0,0 +1,13 @@
+#ifndef _HOSTBENCH_PROC_H_
+#define _HOSTBENCH_PROC_H_
+
+/*
+ * Each bench thread is a process of its own, with the address space
+ * set by hostvm_setas.
+ */
+
+struct addrspace;
+
+struct addrspace *proc_getas(void);
+
+#endif /* _HOSTBENCH_PROC_H_ */
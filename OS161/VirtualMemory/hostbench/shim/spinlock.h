@@ -0,0 +1,54 @@
+#ifndef _HOSTBENCH_SPINLOCK_H_
+#define _HOSTBENCH_SPINLOCK_H_
+
+/*
+ * Spinlocks as pthread mutexes. The owner is kept so that
+ * spinlock_do_i_hold works.
+ */
+
+#include <pthread.h>
+#include <types.h>
+
+struct spinlock {
+    pthread_mutex_t splk_mutex;
+    volatile pthread_t splk_owner;
+    volatile bool splk_held;
+};
+
+#define SPINLOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, false }
+
+static inline void
+spinlock_init(struct spinlock *splk)
+{
+    pthread_mutex_init(&splk->splk_mutex, NULL);
+    splk->splk_held = false;
+}
+
+static inline void
+spinlock_cleanup(struct spinlock *splk)
+{
+    pthread_mutex_destroy(&splk->splk_mutex);
+}
+
+static inline void
+spinlock_acquire(struct spinlock *splk)
+{
+    pthread_mutex_lock(&splk->splk_mutex);
+    splk->splk_owner = pthread_self();
+    splk->splk_held = true;
+}
+
+static inline void
+spinlock_release(struct spinlock *splk)
+{
+    splk->splk_held = false;
+    pthread_mutex_unlock(&splk->splk_mutex);
+}
+
+static inline bool
+spinlock_do_i_hold(struct spinlock *splk)
+{
+    return splk->splk_held && pthread_equal(splk->splk_owner, pthread_self());
+}
+
+#endif /* _HOSTBENCH_SPINLOCK_H_ */
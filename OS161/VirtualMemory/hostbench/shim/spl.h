@@ -0,0 +1,12 @@
+#ifndef _HOSTBENCH_SPL_H_
+#define _HOSTBENCH_SPL_H_
+
+/*
+ * No interrupts on the host. Each bench thread is its own "cpu" and
+ * nothing else touches its per-cpu data, so splhigh can do nothing.
+ */
+
+static inline int splhigh(void) { return 1; }
+static inline int splx(int spl) { (void)spl; return 0; }
+
+#endif /* _HOSTBENCH_SPL_H_ */
@@ -0,0 +1,62 @@
+#ifndef _HOSTBENCH_SYNCH_H_
+#define _HOSTBENCH_SYNCH_H_
+
+/*
+ * Sleep locks as pthread mutexes, with the owner kept so that
+ * lock_do_i_hold works. They are host objects, not kmalloc blocks.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <types.h>
+
+struct lock {
+    pthread_mutex_t lk_mutex;
+    volatile pthread_t lk_owner;
+    volatile bool lk_held;
+};
+
+static inline struct lock *
+lock_create(const char *name)
+{
+    struct lock *lock;
+
+    (void)name;
+    lock = malloc(sizeof(*lock));
+    if (lock == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&lock->lk_mutex, NULL);
+    lock->lk_held = false;
+    return lock;
+}
+
+static inline void
+lock_destroy(struct lock *lock)
+{
+    pthread_mutex_destroy(&lock->lk_mutex);
+    free(lock);
+}
+
+static inline void
+lock_acquire(struct lock *lock)
+{
+    pthread_mutex_lock(&lock->lk_mutex);
+    lock->lk_owner = pthread_self();
+    lock->lk_held = true;
+}
+
+static inline void
+lock_release(struct lock *lock)
+{
+    lock->lk_held = false;
+    pthread_mutex_unlock(&lock->lk_mutex);
+}
+
+static inline bool
+lock_do_i_hold(struct lock *lock)
+{
+    return lock->lk_held && pthread_equal(lock->lk_owner, pthread_self());
+}
+
+#endif /* _HOSTBENCH_SYNCH_H_ */
@@ -0,0 +1,10 @@
+#ifndef _HOSTBENCH_THREAD_H_
+#define _HOSTBENCH_THREAD_H_
+
+/* Only thread_yield, which the VM system calls while out of memory. */
+
+#include <sched.h>
+
+static inline void thread_yield(void) { sched_yield(); }
+
+#endif /* _HOSTBENCH_THREAD_H_ */
@@ -0,0 +1,24 @@
+#ifndef _HOSTBENCH_TYPES_H_
+#define _HOSTBENCH_TYPES_H_
+
+/*
+ * Kernel types on the host. Virtual addresses are host pointers;
+ * physical addresses are offsets into the RAM arena and 32 bits as on
+ * MIPS, so that page tables have the kernel's layout.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uintptr_t vaddr_t;
+typedef uint32_t paddr_t;
+typedef uintptr_t userptr_t;
+
+/* For the structures in kern/ headers. */
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef int32_t __i32;
+
+#endif /* _HOSTBENCH_TYPES_H_ */
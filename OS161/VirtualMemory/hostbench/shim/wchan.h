@@ -0,0 +1,61 @@
+#ifndef _HOSTBENCH_WCHAN_H_
+#define _HOSTBENCH_WCHAN_H_
+
+/*
+ * Wait channels as condition variables on the spinlock's mutex. The
+ * spinlock's owner is cleared while asleep, as wchan_sleep releases it.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <spinlock.h>
+
+struct wchan {
+    pthread_cond_t wc_cond;
+};
+
+static inline struct wchan *
+wchan_create(const char *name)
+{
+    struct wchan *wc;
+
+    (void)name;
+    wc = malloc(sizeof(*wc));
+    if (wc == NULL) {
+        return NULL;
+    }
+    pthread_cond_init(&wc->wc_cond, NULL);
+    return wc;
+}
+
+static inline void
+wchan_destroy(struct wchan *wc)
+{
+    pthread_cond_destroy(&wc->wc_cond);
+    free(wc);
+}
+
+static inline void
+wchan_sleep(struct wchan *wc, struct spinlock *lk)
+{
+    lk->splk_held = false;
+    pthread_cond_wait(&wc->wc_cond, &lk->splk_mutex);
+    lk->splk_owner = pthread_self();
+    lk->splk_held = true;
+}
+
+static inline void
+wchan_wakeone(struct wchan *wc, struct spinlock *lk)
+{
+    (void)lk;
+    pthread_cond_signal(&wc->wc_cond);
+}
+
+static inline void
+wchan_wakeall(struct wchan *wc, struct spinlock *lk)
+{
+    (void)lk;
+    pthread_cond_broadcast(&wc->wc_cond);
+}
+
+#endif /* _HOSTBENCH_WCHAN_H_ */
@@ -39,12 +39,16 @@
 #include "opt-dumbvm.h"
 
 #define PTE_VALID 0x00000200  // used to indicate that this PTE records a physical frame
+#define PTE_DIRTY 0x00000400  // the page was written since it was mapped or last cleaned
 #define TOP_TEN   0xFFC00000  // used to get the index of the first_level page table
 #define MID_TEN   0x003FF000  // used to get the index of the second_level page table
+#define PT_TOP_INDEX(va) (((va) & TOP_TEN) >> 22)
+#define PT_MID_INDEX(va) (((va) & MID_TEN) >> 12)
 
 #define VM_STACKPAGES 16    // the maximum stack size for a process in terms of pages
 
 struct vnode;
+struct lock;
 
 struct as_region {
   vaddr_t as_vbase; /* the started virtual address for one region */
@@ -65,15 +69,29 @@ struct addrspace {
 #else
   /* Put stuff here for your VM system */
   struct as_region *as_regions_start; /* header of the regions linked list */
+  paddr_t *as_pagetable; /* first level of the two-level page table */
+  struct lock *as_lock; /* protects the regions and the page table */
+  unsigned as_resident; /* pages mapped in the page table */
+  bool as_oomkilled; /* chosen by the OOM killer, its faults fail */
+  struct addrspace *as_nextas; /* list of all addrspaces, for the OOM killer */
+  unsigned as_reclaimnext; /* page number vm_reclaim_clean goes on from */
 #endif
 };
 
 /*
  * The structure of PTE in page table:
- * |    address          |  PTE_VALID      |  PE_W        | PF_R        | PF_X
- *  the virtual address of frame | valid indicator | writeable flag | readable flag | executable flag 
- * I don't use structure to represent PTE, just use type vaddr_t, and becuase the last 12 bit is free 
- * for a virtual address of frame, some of they could be used for the flags
+ * |    address          |  PTE_DIRTY  |  PTE_VALID      |  PE_W        | PF_R        | PF_X
+ *  the physical address of frame | dirty flag | valid indicator | writeable flag | readable flag | executable flag 
+ * I don't use structure to represent PTE, just use type paddr_t, and becuase the last 12 bit is free 
+ * for a physical address of frame, some of they could be used for the flags
+ *
+ * Every addrspace owns its page table: as_pagetable[PT_TOP_INDEX(va)] is the
+ * physical address of a second level table of PTE_NUM entries, indexed by
+ * PT_MID_INDEX(va). Each level is one frame from alloc_kpages, and is only
+ * allocated when needed. All the accesses go through as_lock, so faults of
+ * different processes only meet on frametable_lock, for the few
+ * instructions it takes to pop a free frame ("kbench -w faults -t N" in
+ * hostbench/ measures this).
  */
 
 /*
@@ -112,6 +130,19 @@ struct addrspace {
  *    as_zero_region - zero out a new allocated page.
  *
  *    as_destroy_regions - free all the space allocated for regions storeage.
+ *
+ *    as_bootstrap - set up the object caches addrspaces and regions
+ *                are allocated from. Called once from vm_bootstrap.
+ *
+ *    as_oom_kill_largest - pick the addrspace with the most resident pages,
+ *                make every later fault of its process fail and free all
+ *                its pages and page tables. Returns once they are free,
+ *                or once a kill that was already going on has finished.
+ *                Returns false if the caller's own addrspace is the
+ *                largest, or nothing else has pages to give.
+ *
+ *    as_tlbshootdown - flush this cpu's TLB for the OOM killer. Called by
+ *                vm_tlbshootdown on the cpu an IPI was sent to.
  */
 
 struct addrspace *as_create(void);
@@ -128,6 +159,10 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 void      as_zero_region(vaddr_t vaddr, unsigned npages);
+void              as_destroy_regions(struct addrspace *as);
+bool              as_oom_kill_largest(struct addrspace *self);
+void              as_tlbshootdown(void);
+void              as_bootstrap(void);
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
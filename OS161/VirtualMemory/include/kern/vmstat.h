@@ -0,0 +1,22 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * VM statistics, as returned by the vmstat() system call.
+ *
+ * The event counts are totals since boot over all cpus; the frame and
+ * heap figures are what is in use at the time of the call.
+ */
+struct vmstat {
+	__u32 vs_tlbmisses;	/* VM_FAULT_READ and VM_FAULT_WRITE faults */
+	__u32 vs_readonly;	/* VM_FAULT_READONLY faults */
+	__u32 vs_pthits;	/* faults that found the page in the page table */
+	__u32 vs_ptmisses;	/* faults that had to map a new page */
+	__u32 vs_zeroed;	/* pages zero-filled */
+	__u32 vs_copied;	/* pages copied by fork */
+	__u32 vs_framesfree;	/* physical frames free */
+	__u32 vs_framesused;	/* physical frames in use */
+	__u32 vs_kheappages;	/* pages held by kmalloc, subpage and whole */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
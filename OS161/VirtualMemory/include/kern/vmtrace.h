@@ -0,0 +1,35 @@
+#ifndef _KERN_VMTRACE_H_
+#define _KERN_VMTRACE_H_
+
+/*
+ * Page fault tracing, shared between the kernel and the userlevel
+ * tools that read the trace with the vmtrace() system call.
+ */
+
+/* Operations for vmtrace() */
+#define VMTRACE_OFF     0	/* stop recording */
+#define VMTRACE_ON      1	/* clear the buffers and start recording */
+#define VMTRACE_READ    2	/* copy out the recorded events */
+
+/* What vm_fault did with the fault */
+#define VMTRACE_HIT     0	/* page was in the page table, TLB reloaded */
+#define VMTRACE_ALLOC   1	/* page was not mapped, fresh frame allocated */
+#define VMTRACE_DIRTY   2	/* first write to a clean page */
+#define VMTRACE_ERROR   3	/* the fault failed, see vte_error */
+
+/*
+ * One vm_fault() call. vte_asid identifies the address space; it is
+ * only meaningful for comparing events with each other.
+ */
+struct vmtrace_event {
+	__u32 vte_seq;		/* per-cpu sequence number */
+	__u32 vte_addr;		/* faulting address */
+	__u32 vte_asid;		/* address space */
+	__u32 vte_nsecs;	/* time spent in vm_fault */
+	__u16 vte_cpu;		/* cpu that took the fault */
+	__u8 vte_type;		/* VM_FAULT_READ, _WRITE or _READONLY */
+	__u8 vte_result;	/* one of the VMTRACE_ results above */
+	__i32 vte_error;	/* errno if vte_result is VMTRACE_ERROR */
+};
+
+#endif /* _KERN_VMTRACE_H_ */
@@ -0,0 +1,39 @@
+#ifndef _KFENCE_H_
+#define _KFENCE_H_
+
+/*
+ * Sampled guard-page allocator.
+ *
+ * kmalloc sends every kfence_rate'th allocation smaller than a page
+ * here (0 turns it off), except those from kmalloc_nofence. Such a block gets a page of its own in kseg2, which goes
+ * through the TLB, with unmapped guard pages on both sides. Running
+ * off either end of the page, or touching the block after kfree,
+ * takes a TLB fault that kfence_fault turns into a panic with a
+ * report. Smaller overruns into the unused rest of the page are
+ * caught when the block is freed.
+ *
+ *    kfence_alloc  - get a guarded block, or NULL if none is free.
+ *    kfence_free   - free a block from kfence_alloc.
+ *    kfence_fault  - vm_fault for an address in the kfence area; returns
+ *                    the frame to map, or panics on a bad access.
+ *    kfence_menu   - the "kfence" kernel menu command.
+ */
+
+#include <vm.h>
+
+#define KFENCE_NOBJECTS 32
+
+/* Object i's page is the (2i+1)th page; the even pages are guards. */
+#define KFENCE_BASE  MIPS_KSEG2
+#define KFENCE_END   (KFENCE_BASE + (2 * KFENCE_NOBJECTS + 1) * PAGE_SIZE)
+#define KFENCE_ISADDR(va) ((vaddr_t)(va) >= KFENCE_BASE && \
+                           (vaddr_t)(va) < KFENCE_END)
+
+extern volatile unsigned kfence_rate;
+
+void *kfence_alloc(size_t sz, vaddr_t site);
+void kfence_free(void *ptr, vaddr_t site);
+paddr_t kfence_fault(int faulttype, vaddr_t faultaddress);
+int kfence_menu(int nargs, char **args);
+
+#endif /* _KFENCE_H_ */
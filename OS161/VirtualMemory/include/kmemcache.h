@@ -0,0 +1,37 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A cache hands out objects of one fixed size, packed into whole pages
+ * (slabs) without any per-object header. A free object is kept in its
+ * constructed state: the constructor runs once when its slab is made
+ * and the destructor once when the slab is given back, not on every
+ * alloc and free. So an object with a lock inside can keep the lock.
+ *
+ *    kmem_cache_create  - make a cache of objects of SIZE bytes. CTOR
+ *                         and DTOR may be NULL; CTOR returns an errno
+ *                         value. Objects must fit in a page. Returns
+ *                         NULL if out of memory.
+ *    kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *    kmem_cache_free    - give an object back. It must be in the same
+ *                         state the constructor left it in.
+ *    kmem_cache_destroy - get rid of a cache; all its objects must have
+ *                         been freed.
+ *    kmem_cache_printstats - print the statistics of all the caches.
+ *    kmemcache_menu     - the "kcstats" kernel menu command.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     int (*ctor)(void *obj),
+                                     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_destroy(struct kmem_cache *kc);
+void kmem_cache_printstats(void);
+int kmemcache_menu(int nargs, char **args);
+
+#endif /* _KMEMCACHE_H_ */
@@ -123,15 +123,40 @@ uint32_t random(void);
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
+ * kmalloc_nofence is kmalloc for memory that must be usable without
+ * the TLB, such as thread stacks and trapframes: it never hands out a
+ * kfence block.
+ *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_pagesinuse returns the number of pages held by kmalloc: the
+ * subpage allocator's pages plus those of larger blocks, which are
+ * whole pages from alloc_kpages.
+ *
+ * kheap_reclaim gives unused heap bookkeeping pages back to the VM
+ * system and returns how many it freed.
+ *
+ * kheap_bootstrap sizes the heap bookkeeping for the amount of RAM;
+ * vm_bootstrap calls it while memory can still be stolen.
+ *
+ * kheap_profile samples every Nth kmalloc (0 stops) and tracks bytes
+ * per calling site; kheap_profile_report prints the top N sites.
+ * kheap_profile_menu is the "kprof" menu command.
  */
 void *kmalloc(size_t size);
+void *kmalloc_nofence(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+unsigned kheap_pagesinuse(void);
+unsigned kheap_reclaim(void);
+void kheap_bootstrap(void);
+void kheap_profile(unsigned rate);
+void kheap_profile_report(unsigned n);
+int kheap_profile_menu(int nargs, char **args);
 
 /*
  * C string functions.
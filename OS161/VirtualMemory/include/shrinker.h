@@ -0,0 +1,55 @@
+#ifndef _SHRINKER_H_
+#define _SHRINKER_H_
+
+/*
+ * Memory-pressure callbacks.
+ *
+ * A kernel cache that holds pages it could give back registers a
+ * shrinker. When alloc_kpages finds fewer than VM_FRAMES_LOWAT free
+ * frames, or none at all, it calls shrink_caches, which asks each
+ * shrinker with something to give back to free pages until enough
+ * have been freed.
+ *
+ * The callbacks are called without any lock of shrinker.c held, but
+ * maybe from inside alloc_kpages, whose caller may hold spinlocks. So
+ * they must not sleep, and they must not take a lock that may be held
+ * by someone calling alloc_kpages. Only one cpu calls a given
+ * shrinker at a time; if its callback allocates, it is not called
+ * again from in there.
+ *
+ *    sh_count - how many pages the cache could free right now.
+ *    sh_scan  - free up to npages pages (more is allowed if the cache
+ *               cannot do less); returns how many were freed.
+ *
+ *    shrinker_register   - add a shrinker. SH_NAME, SH_COUNT, SH_SCAN
+ *                          and SH_DATA must be set.
+ *    shrinker_unregister - remove it again, waiting (asleep) for a
+ *                          callback that is running; no callback runs
+ *                          after this returns.
+ *    shrink_caches       - try to free npages pages; returns how many
+ *                          were freed.
+ *    shrinker_menu       - the "shrink" kernel menu command.
+ *    shrinker_bootstrap  - set up; vm_bootstrap calls it before the
+ *                          first shrinker is registered.
+ */
+
+struct shrinker {
+    const char *sh_name;
+    unsigned (*sh_count)(void *data);
+    unsigned (*sh_scan)(void *data, unsigned npages);
+    void *sh_data;
+
+    /* Private to shrinker.c */
+    struct shrinker *sh_next;
+    bool sh_busy;               /* a callback is running */
+    unsigned sh_calls;
+    unsigned sh_freed;
+};
+
+void shrinker_register(struct shrinker *sh);
+void shrinker_unregister(struct shrinker *sh);
+unsigned shrink_caches(unsigned npages);
+int shrinker_menu(int nargs, char **args);
+void shrinker_bootstrap(void);
+
+#endif /* _SHRINKER_H_ */
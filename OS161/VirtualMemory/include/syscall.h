@@ -92,4 +92,7 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_vmtrace(int op, userptr_t buf, size_t nevents, int *retval);
+int sys_vmstat(userptr_t buf);
+
 #endif /* _SYSCALL_H_ */
@@ -47,17 +47,31 @@
 
 #define PTE_NUM 1024
 
+#define VM_MAXCPUS 32  /* System/161 supports at most 32 cpus */
+
+/* What vm_fault does when it cannot get a frame, see vm_oom_policy */
+#define VM_OOM_FAIL     0    /* fail the fault, the faulting process dies */
+#define VM_OOM_KILL     1    /* kill the process with the most resident pages */
+#define VM_OOM_PANIC    2    /* panic the kernel */
+#define VM_OOM_RETRIES  16   /* attempts to get a frame before giving up */
+#define VM_RECLAIM_SCAN 32   /* clean pages vm_reclaim_clean looks into per call */
+
+/* Below this many free frames alloc_kpages asks the caches to shrink, */
+#define VM_FRAMES_LOWAT 8
+/* but only once every this many frames it hands out */
+#define VM_FRAMES_LOWAT_INTERVAL 16
+
+struct addrspace;
+
 struct frame_table_entry {
     size_t next_freeframe;
 };
 
-struct page_table_entry{
-    paddr_t frame_addr;
-    vaddr_t page_addr;
-    uint32_t id;
-};
 struct frame_table_entry *frame_table;
-paddr_t frametop, freeframe, pagetop;
+paddr_t frametop, freeframe;
+extern unsigned frames_total, frames_inuse; /* frames_inuse is protected by frametable_lock */
+extern struct spinlock frametable_lock;
+extern int vm_oom_policy; /* one of VM_OOM_*, VM_OOM_KILL by default */
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -73,8 +87,14 @@ void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
 //page table
-struct page_table_entry * page_table_insert(uint32_t id, vaddr_t va, paddr_t pa);
-paddr_t look_up_page_table(uint32_t check_id, vaddr_t va);
-void delete_page_table_entry(uint32_t id);
-int copyPageTable(uint32_t oldas, uint32_t newas);
-#endif /* _VM_H_ */
\ No newline at end of file
+//page_table_insert, look_up_page_table and the dirty bit functions must be
+//called with as->as_lock held,
+//delete_page_table and copyPageTable take the lock themselves
+int page_table_insert(struct addrspace *as, vaddr_t va, paddr_t pa);
+paddr_t look_up_page_table(struct addrspace *as, vaddr_t va);
+void page_table_set_dirty(struct addrspace *as, vaddr_t va);
+bool page_table_is_dirty(struct addrspace *as, vaddr_t va);
+void page_table_clean(struct addrspace *as, vaddr_t va);
+void delete_page_table(struct addrspace *as);
+int copyPageTable(struct addrspace *oldas, struct addrspace *newas);
+#endif /* _VM_H_ */
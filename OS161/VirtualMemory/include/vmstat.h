@@ -0,0 +1,35 @@
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+/*
+ * VM statistics counters.
+ *
+ * Each cpu counts events in its own set of counters, so the fault path
+ * never touches a shared cache line; vmstat_get adds them up. An update
+ * is done with interrupts off on the current cpu and takes no lock.
+ *
+ *    vmstat_inc/add - count one or n events of a kind.
+ *    vmstat_get     - fill in a struct vmstat with the totals and the
+ *                     current frame and heap usage.
+ *    vmstat_menu    - the "vmstat" kernel menu command.
+ *
+ * sys_vmstat is in syscall.h.
+ */
+
+#include <kern/vmstat.h>
+
+/* The counters */
+#define VMSTAT_TLBMISS   0
+#define VMSTAT_READONLY  1
+#define VMSTAT_PTHIT     2
+#define VMSTAT_PTMISS    3
+#define VMSTAT_ZEROED    4
+#define VMSTAT_COPIED    5
+#define VMSTAT_NCOUNTERS 6
+
+void vmstat_add(unsigned which, unsigned n);
+#define vmstat_inc(which) vmstat_add(which, 1)
+void vmstat_get(struct vmstat *vs);
+int vmstat_menu(int nargs, char **args);
+
+#endif /* _VMSTAT_H_ */
@@ -0,0 +1,40 @@
+#ifndef _VMTRACE_H_
+#define _VMTRACE_H_
+
+/*
+ * Page fault tracing.
+ *
+ * Each cpu records its vm_fault() events in its own ring of
+ * VMTRACE_NEVENTS entries; when a ring is full the oldest events are
+ * overwritten. A cpu only ever writes its own ring, with interrupts
+ * off, so recording takes no lock. When tracing is off, vm_fault only
+ * pays for the test of vmtrace_enabled. The rings are allocated the
+ * first time tracing is turned on and kept afterwards.
+ *
+ *    vmtrace_record - record one fault; called by vm_fault.
+ *    vmtrace_set    - turn tracing on (clearing the rings) or off.
+ *    vmtrace_read   - copy up to max events, oldest first per cpu, into
+ *                     a kernel buffer, leaving out the first skip events;
+ *                     returns the number copied.
+ *    vmtrace_menu   - the "vmtrace" kernel menu command.
+ *
+ * sys_vmtrace is in syscall.h.
+ */
+
+#include <kern/vmtrace.h>
+
+#define VMTRACE_NEVENTS 128	/* per cpu, must be a power of 2 */
+
+struct addrspace;
+struct timespec;
+
+extern volatile bool vmtrace_enabled;
+
+void vmtrace_record(int faulttype, vaddr_t faultaddress, struct addrspace *as,
+		    int outcome, int error,
+		    const struct timespec *start, const struct timespec *end);
+int vmtrace_set(bool on);
+unsigned vmtrace_read(struct vmtrace_event *buf, unsigned max, unsigned skip);
+int vmtrace_menu(int nargs, char **args);
+
+#endif /* _VMTRACE_H_ */
@@ -39,17 +39,90 @@
 #include <spinlock.h>
 #include <elf.h>
 #include <proc.h>
+#include <synch.h>
+#include <vmstat.h>
+#include <kmemcache.h>
+#include <cpu.h>
+#include <wchan.h>
 
 
+/*
+ * All the addrspaces, so that the OOM killer can find the largest one.
+ *
+ * as_loaded[n] is the addrspace whose entries the TLB of cpu n may hold:
+ * as_activate flushes the TLB and sets it. as_oomvictim is the addrspace
+ * the OOM killer is tearing down, one at a time; the killer waits on
+ * as_oom_wchan for the cpus it sent a shootdown to, and the others wait
+ * there for it to finish. All of it is protected by as_list_lock.
+ */
+static struct spinlock as_list_lock = SPINLOCK_INITIALIZER;
+static struct addrspace *as_list;
+static struct addrspace *as_loaded[VM_MAXCPUS];
+static struct cpu *as_loadedcpu[VM_MAXCPUS];
+static struct addrspace *as_oomvictim;
+static struct wchan *as_oom_wchan;
+
+/*
+ * Object caches for addrspaces and regions. A free addrspace in the
+ * cache keeps its as_lock, so as_create doesn't make a new lock every
+ * time.
+ */
+static struct kmem_cache *as_cache;
+static struct kmem_cache *as_region_cache;
+
+static
+int
+as_ctor(void *obj)
+{
+    struct addrspace *as = obj;
+    as->as_lock = lock_create("as_lock");
+    if (as->as_lock == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static
+void
+as_dtor(void *obj)
+{
+    struct addrspace *as = obj;
+    lock_destroy(as->as_lock);
+}
+
+/*
+ * Set up the caches, called from vm_bootstrap.
+ */
+void
+as_bootstrap(void)
+{
+    as_cache = kmem_cache_create("addrspace", sizeof(struct addrspace),
+                                 as_ctor, as_dtor);
+    as_region_cache = kmem_cache_create("as_region",
+                                        sizeof(struct as_region), NULL, NULL);
+    as_oom_wchan = wchan_create("as_oom");
+    if (as_cache == NULL || as_region_cache == NULL || as_oom_wchan == NULL) {
+        panic("as_bootstrap: Out of memory\n");
+    }
+}
+
 struct addrspace *
 as_create(void)
 {
     struct addrspace *as;
-    as = kmalloc(sizeof(struct addrspace));
+    as = kmem_cache_alloc(as_cache);
     if (as == NULL) {
         return NULL;
     }
     as->as_regions_start = NULL;
+    as->as_pagetable = NULL;
+    as->as_resident = 0;
+    as->as_oomkilled = false;
+    as->as_reclaimnext = 0;
+    spinlock_acquire(&as_list_lock);
+    as->as_nextas = as_list;
+    as_list = as;
+    spinlock_release(&as_list_lock);
     return as;
 }
 
@@ -57,70 +130,251 @@ as_create(void)
  * Copy all the contents of the old addrspace to the new addrspace.
  * Both the page frames mapped in the two-level page table of
  * the old addrspace to the new addrspace and the regions keeped in 
- * the old one.
+ * the old one. The old addrspace is locked while its regions are read.
+ * If memory runs out everything built so far is given back and ENOMEM
+ * is returned, so fork just fails.
  */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
     struct addrspace *new;
-    struct as_region *re, *newre, *oldre;
+    struct as_region *re, *newre, **tail;
     int ret_value;
     // initialise the new addrspace
     new = as_create();
     if (new==NULL) {
         return ENOMEM;
     }
-    re = old->as_regions_start;
-    if (re == 0) {
-        return 0;
-    }
-    newre = kmalloc(sizeof(struct as_region));
-    KASSERT(re->as_vbase != 0);
-    KASSERT(re->as_npages != 0);
-    newre->as_vbase = re->as_vbase;
-    newre->as_npages = re->as_npages;
-    newre->as_permissions = re->as_permissions;
-    newre->as_next_region = 0;
-    new->as_regions_start = newre;
-    re = re->as_next_region;
+    lock_acquire(old->as_lock);
     //copy all the regions to the new as
-    while (re != 0) {
-        oldre = newre;
-        newre = kmalloc(sizeof(struct as_region));
+    tail = &new->as_regions_start;
+    for (re = old->as_regions_start; re != 0; re = re->as_next_region) {
         KASSERT(re->as_vbase != 0);
         KASSERT(re->as_npages != 0);
+        newre = kmem_cache_alloc(as_region_cache);
+        if (newre == NULL) {
+            lock_release(old->as_lock);
+            as_destroy(new);
+            return ENOMEM;
+        }
         newre->as_vbase = re->as_vbase;
         newre->as_npages = re->as_npages;
         newre->as_permissions = re->as_permissions;
         newre->as_next_region = 0;
-        oldre->as_next_region = newre;
-        re = re->as_next_region;
+        *tail = newre;
+        tail = &newre->as_next_region;
     }  
+    lock_release(old->as_lock);
     // copy the contents of the old two-level page table
     // to the new one
-    ret_value = copyPageTable((uint32_t)old, (uint32_t)new);
-    if (ret_value) return ret_value;
+    ret_value = copyPageTable(old, new);
+    if (ret_value) {
+        as_destroy(new);
+        return ret_value;
+    }
     *ret = new;
     return 0;
 }
 
+/*
+ * Free all the space allocated for regions storeage
+ */
+void
+as_destroy_regions(struct addrspace *as)
+{
+    struct as_region *re, *next;
+    for (re = as->as_regions_start; re != 0; re = next) {
+        next = re->as_next_region;
+        kmem_cache_free(as_region_cache, re);
+    }
+    as->as_regions_start = NULL;
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-    delete_page_table_entry((uint32_t)as);
-    kfree(as);
+    struct addrspace **p;
+    unsigned i;
+    spinlock_acquire(&as_list_lock);
+    for (p = &as_list; *p != NULL; p = &(*p)->as_nextas) {
+        if (*p == as) {
+            *p = as->as_nextas;
+            break;
+        }
+    }
+    // the OOM killer may be tearing it down already
+    while (as_oomvictim == as) {
+        wchan_sleep(as_oom_wchan, &as_list_lock);
+    }
+    for (i = 0; i < VM_MAXCPUS; i++) {
+        if (as_loaded[i] == as) {
+            as_loaded[i] = NULL;
+        }
+    }
+    spinlock_release(&as_list_lock);
+    delete_page_table(as);
+    as_destroy_regions(as);
+    kmem_cache_free(as_cache, as);
 }
 
 /*
- * Frobe TLB table
+ * Invalidate every entry of this cpu's TLB. Call with interrupts off.
  */
+static
 void
-as_activate(void)
+as_tlbflush(void)
 {
-    int spl = splhigh();
     for (int i = 0; i < NUM_TLB; i++) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
     }
+}
+
+/*
+ * Free the pages of victim, which is as_oomvictim and already marked, so
+ * its faults fail from now on. Faults only load the TLB with as_lock held
+ * and after looking at as_oomkilled, so once we have the lock no new
+ * entries of victim show up. The cpus whose TLB may still hold some are
+ * sent a shootdown, and we wait until they have flushed before the
+ * frames are given back.
+ */
+static
+void
+as_oom_reap(struct addrspace *victim)
+{
+    struct tlbshootdown ts;
+    struct cpu *targets[VM_MAXCPUS];
+    unsigned i, ntargets = 0;
+    bool loaded;
+
+    bzero(&ts, sizeof(ts));
+    lock_acquire(victim->as_lock);
+    spinlock_acquire(&as_list_lock);
+    for (i = 0; i < VM_MAXCPUS; i++) {
+        if (as_loaded[i] != victim) {
+            continue;
+        }
+        if (i == curcpu->c_number) {
+            as_tlbflush();
+            as_loaded[i] = NULL;
+        }
+        else {
+            targets[ntargets++] = as_loadedcpu[i];
+        }
+    }
+    spinlock_release(&as_list_lock);
+    // not with as_list_lock held, the IPI handler takes it
+    for (i = 0; i < ntargets; i++) {
+        ipi_tlbshootdown(targets[i], &ts);
+    }
+    spinlock_acquire(&as_list_lock);
+    do {
+        loaded = false;
+        for (i = 0; i < VM_MAXCPUS; i++) {
+            if (as_loaded[i] == victim) {
+                loaded = true;
+            }
+        }
+        if (loaded) {
+            wchan_sleep(as_oom_wchan, &as_list_lock);
+        }
+    } while (loaded);
+    spinlock_release(&as_list_lock);
+    lock_release(victim->as_lock);
+
+    delete_page_table(victim);
+}
+
+/*
+ * OOM killer: take the addrspace with the most resident pages, make its
+ * faults fail so the process dies, and give back all its pages now. Its
+ * process does not have to run for that: a victim asleep in the kernel
+ * keeps sleeping but holds no frames, and fails its first fault when it
+ * is back in user mode. Addrspaces killed earlier have nothing left and
+ * are passed over.
+ * Returns true once a victim's pages are free, or once a kill somebody
+ * else started has finished; false if self is the largest or nothing
+ * else has any pages, in which case the caller should fail itself.
+ */
+bool
+as_oom_kill_largest(struct addrspace *self)
+{
+    struct addrspace *as, *victim = NULL;
+    unsigned resident;
+    spinlock_acquire(&as_list_lock);
+    if (as_oomvictim != NULL) {
+        // its frames are about to be free, wait for them
+        while (as_oomvictim != NULL) {
+            wchan_sleep(as_oom_wchan, &as_list_lock);
+        }
+        spinlock_release(&as_list_lock);
+        return true;
+    }
+    for (as = as_list; as != NULL; as = as->as_nextas) {
+        if (as->as_oomkilled) {
+            continue;
+        }
+        // as_resident is read without as_lock, a hint is good enough here
+        if (victim == NULL || as->as_resident > victim->as_resident) {
+            victim = as;
+        }
+    }
+    if (victim == NULL || victim == self || victim->as_resident == 0) {
+        spinlock_release(&as_list_lock);
+        return false;
+    }
+    victim->as_oomkilled = true;
+    as_oomvictim = victim;
+    resident = victim->as_resident;
+    spinlock_release(&as_list_lock);
+    kprintf("vm: out of memory, killing the process of addrspace %p (%u pages)\n",
+            victim, resident);
+
+    as_oom_reap(victim);
+
+    spinlock_acquire(&as_list_lock);
+    as_oomvictim = NULL;
+    wchan_wakeall(as_oom_wchan, &as_list_lock);
+    spinlock_release(&as_list_lock);
+    return true;
+}
+
+/*
+ * Shootdown sent by as_oom_reap: flush this cpu's TLB. If it was loaded
+ * with the victim's entries, none can come back since the victim's faults
+ * fail, so the killer need not wait for this cpu any more.
+ */
+void
+as_tlbshootdown(void)
+{
+    unsigned cpunum;
+    int spl = splhigh();
+    spinlock_acquire(&as_list_lock);
+    cpunum = curcpu->c_number;
+    as_tlbflush();
+    if (as_oomvictim != NULL && as_loaded[cpunum] == as_oomvictim) {
+        as_loaded[cpunum] = NULL;
+        wchan_wakeall(as_oom_wchan, &as_list_lock);
+    }
+    spinlock_release(&as_list_lock);
+    splx(spl);
+}
+
+/*
+ * Frobe TLB table, and note whose entries it gets from now on
+ */
+void
+as_activate(void)
+{
+    struct addrspace *as = proc_getas();
+    unsigned cpunum;
+    int spl = splhigh();
+    spinlock_acquire(&as_list_lock);
+    cpunum = curcpu->c_number;
+    KASSERT(cpunum < VM_MAXCPUS);
+    as_tlbflush();
+    as_loaded[cpunum] = as;
+    as_loadedcpu[cpunum] = curcpu;
+    spinlock_release(&as_list_lock);
     splx(spl);
 }
 
@@ -138,7 +392,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
          int readable, int writeable, int executable)
 {
     size_t npages;
-    struct as_region *ar;
+    struct as_region *ar, *last;
     
     KASSERT(as != NULL);
     
@@ -151,32 +405,28 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
     npages = sz / PAGE_SIZE;
     
     // Store the region base, size and permissions
+    ar = kmem_cache_alloc(as_region_cache);
+    if (ar == NULL) {
+        return ENOMEM;
+    }
+    ar->as_vbase = vaddr;
+    ar->as_npages = npages;
+    ar->as_permissions = readable | writeable | executable;
+    ar->as_next_region = 0;
+
+    // append it at the end of the list
+    lock_acquire(as->as_lock);
     if (as->as_regions_start == NULL) {
-        as->as_regions_start = kmalloc(sizeof(struct as_region));
-        as->as_regions_start->as_vbase = vaddr;
-        as->as_regions_start->as_npages = npages;
-        as->as_regions_start->as_permissions = readable | writeable | executable;
-        as->as_regions_start->as_next_region = 0;
-        if(as->as_regions_start == NULL){
-            panic("Region cannot be created");
-            return ENOMEM;
-        }
+        as->as_regions_start = ar;
     }
     else {
-        ar = as->as_regions_start;
-        while (ar->as_next_region != 0) {
-            ar = ar->as_next_region;
-        }
-        ar->as_next_region = kmalloc(sizeof(struct as_region));
-        ar->as_next_region->as_vbase = vaddr;
-        ar->as_next_region->as_npages = npages;
-        ar->as_next_region->as_permissions = readable | writeable | executable;
-        ar->as_next_region->as_next_region = 0;
-        if(ar->as_next_region == NULL){
-            panic("Region cannot be created");
-            return ENOMEM;
+        last = as->as_regions_start;
+        while (last->as_next_region != 0) {
+            last = last->as_next_region;
         }
+        last->as_next_region = ar;
     }
+    lock_release(as->as_lock);
     return 0;
 }
 
@@ -221,6 +471,9 @@ as_complete_load(struct addrspace *as)
         s->as_permissions >>= 8;
         s = s->as_next_region;
     }
+    // drop the writable TLB entries loaded while the segments were loaded,
+    // read only pages then trap on write again
+    as_activate();
     return 0;
 }
 
@@ -243,6 +496,7 @@ void
 as_zero_region(vaddr_t vaddr, unsigned npages)
 {
     bzero((void *)vaddr, npages * PAGE_SIZE);
+    vmstat_add(VMSTAT_ZEROED, npages);
 }
 
 void
@@ -4,6 +4,7 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <shrinker.h>
 
 /* 
  * Place your frametable data-structures here 
@@ -23,10 +24,19 @@
  * Make variables static to prevent it from other file's accessing
  */
 struct spinlock frametable_lock = SPINLOCK_INITIALIZER;
+unsigned frames_total, frames_inuse;
+static unsigned frames_lowat_countdown; /* protected by frametable_lock */
 
 /*
  * Allocation function for public accessing
  * Returning virtual address of frame
+ * Only frametable_lock is taken here, it is never held together with the
+ * page table of an addrspace, and vm_fault zeroes the frame after it is released.
+ * When fewer than VM_FRAMES_LOWAT frames are left the kernel caches are
+ * asked to give some back (every VM_FRAMES_LOWAT_INTERVAL frames, as
+ * they don't refill that fast), and when none are left we ask them once more
+ * before failing. This is done without frametable_lock, since the caches
+ * free their pages with free_kpages.
  */
 vaddr_t
 alloc_kpages(unsigned int npages)
@@ -34,6 +44,9 @@ alloc_kpages(unsigned int npages)
         paddr_t paddr;
         struct frame_table_entry *p;
         int i;
+        unsigned nfree, wanted = 0;
+        bool shrunk = false;
+again:
         spinlock_acquire(&frametable_lock);
         if (frame_table == 0){
                 paddr = ram_stealmem(npages);
@@ -47,6 +60,10 @@ alloc_kpages(unsigned int npages)
                 // and there is no frame to use.
                 if (freeframe == 0){
                         spinlock_release(&frametable_lock);
+                        if (!shrunk && shrink_caches(VM_FRAMES_LOWAT) > 0) {
+                                shrunk = true;
+                                goto again;
+                        }
                         return 0;
                 }
                 
@@ -56,12 +73,24 @@ alloc_kpages(unsigned int npages)
                 i = (freeframe - frametop) / PAGE_SIZE;
                 p = frame_table + i;
                 freeframe = p->next_freeframe;
-                if(paddr==freeframe){
-                        return 0;
-                }
                 p->next_freeframe = 0;//set used
+                frames_inuse++;
+                nfree = frames_total - frames_inuse;
+                if (nfree < VM_FRAMES_LOWAT) {
+                        if (frames_lowat_countdown == 0) {
+                                wanted = VM_FRAMES_LOWAT - nfree;
+                                frames_lowat_countdown = VM_FRAMES_LOWAT_INTERVAL;
+                        }
+                        else {
+                                frames_lowat_countdown--;
+                        }
+                }
         }
         spinlock_release(&frametable_lock);
+        if (wanted > 0 && !shrunk) {
+                // running low, trim the caches before we run out
+                shrink_caches(wanted);
+        }
         if(paddr == 0)
                 return 0;
         return PADDR_TO_KVADDR(paddr);
@@ -86,6 +115,7 @@ free_kpages(vaddr_t addr)
                 p = frame_table + i;
                 p->next_freeframe = freeframe;
                 freeframe = paddr;
+                frames_inuse--;
                 spinlock_release(&frametable_lock);
         }
 }
\ No newline at end of file
@@ -0,0 +1,307 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <machine/tlb.h>
+#include <kfence.h>
+
+/*
+ * Sampled guard-page allocator. See kfence.h.
+ *
+ * The objects' pages have no fixed frames: kfence_alloc takes a frame
+ * for the block and kfence_free gives it back, after dropping the
+ * page from this cpu's TLB. So after kfree the next access misses in
+ * the TLB and kfence_fault finds the object freed. There is no TLB
+ * shootdown, so a stale entry on another cpu can still let a use
+ * after free through until it is evicted or the cpu switches
+ * addrspaces.
+ *
+ * Blocks are put at the end of their page on even objects, to catch
+ * overruns, and at the start on odd ones, to catch underruns. The rest
+ * of the page is filled with KFENCE_CANARY and checked at kfree. Freed
+ * objects go to the back of the queue, so that an object stays freed
+ * (and so trapping) for as long as possible before reuse.
+ */
+
+#define KFENCE_CANARY 0xaa
+#define KFENCE_ALIGN  8
+
+#define KO_UNUSED    0
+#define KO_ALLOCATED 1
+#define KO_FREED     2
+
+struct kfence_object {
+    int ko_state;
+    vaddr_t ko_frame;           /* kseg0 address of the frame, if allocated */
+    vaddr_t ko_addr;            /* the block, in the kfence area */
+    size_t ko_size;
+    vaddr_t ko_allocsite;
+    vaddr_t ko_freesite;
+    struct kfence_object *ko_next;  /* free queue */
+};
+
+volatile unsigned kfence_rate;
+
+static struct spinlock kfence_lock = SPINLOCK_INITIALIZER;
+static struct kfence_object kfence_objects[KFENCE_NOBJECTS];
+static struct kfence_object *kfence_head, *kfence_tail;
+static bool kfence_initialized;
+static unsigned kfence_nallocs, kfence_nfrees, kfence_nfull;
+
+#define KO_INDEX(ko) ((unsigned)((ko) - kfence_objects))
+#define KO_PAGE(ko)  (KFENCE_BASE + (2 * KO_INDEX(ko) + 1) * PAGE_SIZE)
+
+/*
+ * Put all the objects on the free queue. Call with kfence_lock held.
+ */
+static
+void
+kfence_init(void)
+{
+    unsigned i;
+
+    for (i = 0; i < KFENCE_NOBJECTS; i++) {
+        kfence_objects[i].ko_state = KO_UNUSED;
+        kfence_objects[i].ko_next =
+            (i + 1 < KFENCE_NOBJECTS) ? &kfence_objects[i + 1] : NULL;
+    }
+    kfence_head = &kfence_objects[0];
+    kfence_tail = &kfence_objects[KFENCE_NOBJECTS - 1];
+    kfence_initialized = true;
+}
+
+static
+void
+kfence_enqueue(struct kfence_object *ko)
+{
+    ko->ko_next = NULL;
+    if (kfence_tail == NULL) {
+        kfence_head = ko;
+    }
+    else {
+        kfence_tail->ko_next = ko;
+    }
+    kfence_tail = ko;
+}
+
+/*
+ * Print what we know about KO after a bad access or free at ADDR.
+ */
+static
+void
+kfence_report(const char *what, vaddr_t addr, struct kfence_object *ko)
+{
+    kprintf("kfence: %s at 0x%08lx\n", what, (unsigned long)addr);
+    if (ko == NULL || ko->ko_state == KO_UNUSED) {
+        return;
+    }
+    kprintf("kfence: block 0x%08lx size %lu allocated by 0x%08lx",
+            (unsigned long)ko->ko_addr, (unsigned long)ko->ko_size,
+            (unsigned long)ko->ko_allocsite);
+    if (ko->ko_state == KO_FREED) {
+        kprintf(", freed by 0x%08lx", (unsigned long)ko->ko_freesite);
+    }
+    kprintf("\n");
+}
+
+void *
+kfence_alloc(size_t sz, vaddr_t site)
+{
+    struct kfence_object *ko;
+    vaddr_t frame, offset;
+
+    KASSERT(sz > 0 && sz <= PAGE_SIZE);
+
+    spinlock_acquire(&kfence_lock);
+    if (!kfence_initialized) {
+        kfence_init();
+    }
+    ko = kfence_head;
+    if (ko == NULL) {
+        kfence_nfull++;
+        spinlock_release(&kfence_lock);
+        return NULL;
+    }
+    kfence_head = ko->ko_next;
+    if (kfence_head == NULL) {
+        kfence_tail = NULL;
+    }
+    spinlock_release(&kfence_lock);
+
+    frame = alloc_kpages(1);
+    if (frame == 0) {
+        spinlock_acquire(&kfence_lock);
+        kfence_enqueue(ko);
+        spinlock_release(&kfence_lock);
+        return NULL;
+    }
+    memset((void *)frame, KFENCE_CANARY, PAGE_SIZE);
+
+    if (KO_INDEX(ko) % 2 == 0) {
+        offset = (PAGE_SIZE - sz) & ~(vaddr_t)(KFENCE_ALIGN - 1);
+    }
+    else {
+        offset = 0;
+    }
+
+    spinlock_acquire(&kfence_lock);
+    ko->ko_state = KO_ALLOCATED;
+    ko->ko_frame = frame;
+    ko->ko_addr = KO_PAGE(ko) + offset;
+    ko->ko_size = sz;
+    ko->ko_allocsite = site;
+    ko->ko_freesite = 0;
+    kfence_nallocs++;
+    spinlock_release(&kfence_lock);
+
+    return (void *)ko->ko_addr;
+}
+
+void
+kfence_free(void *ptr, vaddr_t site)
+{
+    struct kfence_object *ko;
+    vaddr_t page, frame;
+    unsigned char *p;
+    unsigned i, start, end;
+    int spl, tlbix;
+
+    KASSERT(KFENCE_ISADDR(ptr));
+    page = (vaddr_t)ptr & PAGE_FRAME;
+    i = (page - KFENCE_BASE) / PAGE_SIZE;
+
+    spinlock_acquire(&kfence_lock);
+    ko = (i % 2 == 1) ? &kfence_objects[i / 2] : NULL;
+    if (ko == NULL || ko->ko_state == KO_UNUSED ||
+        ko->ko_addr != (vaddr_t)ptr) {
+        kfence_report("invalid free", (vaddr_t)ptr, ko);
+        panic("kfence: invalid free of %p\n", ptr);
+    }
+    if (ko->ko_state == KO_FREED) {
+        kfence_report("double free", (vaddr_t)ptr, ko);
+        panic("kfence: double free of %p\n", ptr);
+    }
+
+    /* Check the rest of the page for small overruns. */
+    p = (unsigned char *)ko->ko_frame;
+    start = ko->ko_addr - page;
+    end = start + ko->ko_size;
+    for (i = 0; i < PAGE_SIZE; i++) {
+        if (i == start) {
+            i = end - 1;
+            continue;
+        }
+        if (p[i] != KFENCE_CANARY) {
+            kfence_report("out-of-bounds write", page + i, ko);
+            panic("kfence: heap corruption next to %p\n", ptr);
+        }
+    }
+
+    frame = ko->ko_frame;
+    ko->ko_state = KO_FREED;
+    ko->ko_frame = 0;
+    ko->ko_freesite = site;
+    kfence_nfrees++;
+
+    spl = splhigh();
+    tlbix = tlb_probe(page, 0);
+    if (tlbix >= 0) {
+        tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
+    }
+    splx(spl);
+
+    kfence_enqueue(ko);
+    spinlock_release(&kfence_lock);
+
+    free_kpages(frame);
+}
+
+/*
+ * TLB fault in the kfence area: map the page if it holds a live block,
+ * otherwise it's a bug in whoever touched it.
+ */
+paddr_t
+kfence_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct kfence_object *ko, *left, *right;
+    unsigned i;
+    paddr_t paddr;
+
+    KASSERT(KFENCE_ISADDR(faultaddress));
+    i = (faultaddress - KFENCE_BASE) / PAGE_SIZE;
+
+    spinlock_acquire(&kfence_lock);
+    if (i % 2 == 1) {
+        ko = &kfence_objects[i / 2];
+        if (ko->ko_state == KO_ALLOCATED) {
+            paddr = KVADDR_TO_PADDR(ko->ko_frame);
+            spinlock_release(&kfence_lock);
+            return paddr;
+        }
+        kfence_report(ko->ko_state == KO_FREED ?
+                      "use after free" : "access to unused object",
+                      faultaddress, ko);
+    }
+    else {
+        /* A guard page; blame the nearer live neighbour. */
+        left = (i > 0) ? &kfence_objects[i / 2 - 1] : NULL;
+        right = (i / 2 < KFENCE_NOBJECTS) ? &kfence_objects[i / 2] : NULL;
+        if (left != NULL && left->ko_state != KO_ALLOCATED) {
+            left = NULL;
+        }
+        if (right != NULL && right->ko_state != KO_ALLOCATED) {
+            right = NULL;
+        }
+        if (left != NULL && right != NULL) {
+            if (faultaddress - (left->ko_addr + left->ko_size) <
+                right->ko_addr - faultaddress) {
+                right = NULL;
+            }
+            else {
+                left = NULL;
+            }
+        }
+        kfence_report("out-of-bounds access", faultaddress,
+                      left != NULL ? left : right);
+    }
+    spinlock_release(&kfence_lock);
+    panic("kfence: bad %s at 0x%08lx\n",
+          faulttype == VM_FAULT_READ ? "read" : "write",
+          (unsigned long)faultaddress);
+    return 0;
+}
+
+/*
+ * Kernel menu command:
+ *    kfence N  - guard every Nth small kmalloc (0 turns it off)
+ *    kfence    - print the statistics
+ */
+int
+kfence_menu(int nargs, char **args)
+{
+    unsigned i, inuse = 0;
+
+    if (nargs == 2) {
+        kfence_rate = atoi(args[1]);
+        return 0;
+    }
+    if (nargs != 1) {
+        kprintf("Usage: kfence [rate]\n");
+        return EINVAL;
+    }
+
+    spinlock_acquire(&kfence_lock);
+    for (i = 0; i < KFENCE_NOBJECTS; i++) {
+        if (kfence_objects[i].ko_state == KO_ALLOCATED) {
+            inuse++;
+        }
+    }
+    kprintf("kfence: 1 in %u sampled, %u/%u objects in use\n",
+            kfence_rate, inuse, KFENCE_NOBJECTS);
+    kprintf("kfence: %u allocs, %u frees, %u times full\n",
+            kfence_nallocs, kfence_nfrees, kfence_nfull);
+    spinlock_release(&kfence_lock);
+    return 0;
+}
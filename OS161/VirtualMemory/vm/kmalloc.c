@@ -28,9 +28,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kfence.h>
+#include <shrinker.h>
 
 /*
  * Kernel malloc.
@@ -121,16 +128,55 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES puts per-cpu caches of free blocks in front of the
+ * subpage allocator (see below). Blocks that go through them skip
+ * the per-block work of the debugging modes, so it is turned off
+ * when any of those is on.
+ */
+
+#define MAGAZINES
+
+#if defined(SLOW) || defined(SLOWER) || defined(GUARDS) || defined(LABELS)
+#undef MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Besides the powers of two there is a size halfway between each pair
+ * from 32 up, so a block is never more than a third too big. 1360 is
+ * used instead of 1536 because three of them fit on a page, where
+ * 1536 fits only two, the same as 2048.
+ */
+#define NSIZES 14
+static const size_t sizes[NSIZES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1360, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+/*
+ * Block type for each size, in units of 16 bytes rounded up, so
+ * blocktype() doesn't have to search sizes[]. Must be kept in sync
+ * with sizes[].
+ */
+#define SIZEINDEX_UNIT 16
+static const uint8_t sizeindex[LARGEST_SUBPAGE_SIZE / SIZEINDEX_UNIT + 1] = {
+	 0,  0,  1,  2,  3,  4,  4,  5,  5,  6,  6,  6,  6,  7,  7,  7,
+	 7,  8,  8,  8,  8,  8,  8,  8,  8,  9,  9,  9,  9,  9,  9,  9,
+	 9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+	10, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+	11, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+	12, 12, 12, 12, 12, 12, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+	13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+	13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+	13,
+};
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -143,9 +189,16 @@ struct freelist {
 	struct freelist *next;
 };
 
+/*
+ * The prev_ fields point at whatever points at us (the list head or
+ * the previous entry's next_ field), so a pageref can be taken off
+ * its lists without searching them.
+ */
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref **prev_samesize;
 	struct pageref *next_all;
+	struct pageref **prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -154,28 +207,120 @@ struct pageref {
 #define INVALID_OFFSET   (0xffff)
 
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
-#define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
+#define PR_SAMPLED       0x800	/* may have profiled blocks, see below */
+#define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME & ~PR_SAMPLED)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. The per-cpu magazines (see
+ * MAGAZINES) keep most kmalloc and kfree calls from taking it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Number of pages held by the subpage allocator, heap pages plus
+ * pageref pages. Protected by kmalloc_spinlock.
+ */
+static unsigned kheap_npages;
+
+/*
+ * Number of pages of blocks too big for the subpage allocator that are
+ * allocated and not freed yet. kfree doesn't know how many pages such a
+ * block had, but after boot alloc_kpages only gives out single pages;
+ * the multi-page blocks stolen at boot are never given back, so they
+ * stay counted. Protected by kmalloc_spinlock.
+ */
+static unsigned kheap_nlargepages;
+
+/*
+ * Number of subpage requests per block type and the bytes asked for,
+ * for the fragmentation report in kheap_printstats. Kept per cpu so
+ * the magazine path doesn't need the lock to count.
+ */
+struct kheap_reqstats {
+	unsigned rs_count;
+	uint64_t rs_bytes;
+};
+
+static struct kheap_reqstats kheap_reqstats[VM_MAXCPUS][NSIZES];
+
+static
+void
+countrequest(unsigned blktype, size_t sz)
+{
+	unsigned cpunum = 0;
+	int spl;
+
+	spl = splhigh();
+	/* Before there are cpus there is only one. */
+	if (CURCPU_EXISTS()) {
+		cpunum = curcpu->c_number;
+	}
+	if (cpunum < VM_MAXCPUS) {
+		kheap_reqstats[cpunum][blktype].rs_count++;
+		kheap_reqstats[cpunum][blktype].rs_bytes += sz;
+	}
+	splx(spl);
+}
+
+/*
+ * The pageref of each physical page that is a subpage heap page; NULL
+ * for all other pages. This lets kfree find the page a pointer is on
+ * without walking allbase. Written under kmalloc_spinlock; reading it
+ * without the lock is safe for a pointer that is really allocated,
+ * because its page can't go away.
+ *
+ * kheap_bootstrap makes it big enough for all of RAM. Before that
+ * there is no table, and kfree has to search allbase.
+ */
+
+static struct pageref **kheap_pagerefs;
+static unsigned kheap_maxpages;
+
+static
+void
+setpageref(vaddr_t page, struct pageref *pr)
+{
+	paddr_t pa = KVADDR_TO_PADDR(page);
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (pa / PAGE_SIZE < kheap_maxpages) {
+		kheap_pagerefs[pa / PAGE_SIZE] = pr;
+	}
+}
+
+/*
+ * Look up the pageref for the page ADDR is on. Returns NULL if it's
+ * not a heap page, or if it's past the end of kheap_pagerefs.
+ */
+static
+struct pageref *
+getpageref(vaddr_t addr)
+{
+	paddr_t pa = KVADDR_TO_PADDR(addr);
+
+	if (addr < MIPS_KSEG0 || pa / PAGE_SIZE >= kheap_maxpages) {
+		return NULL;
+	}
+	return kheap_pagerefs[pa / PAGE_SIZE];
+}
+
+#ifdef MAGAZINES
+static void mag_flush(void);
+#endif
+static unsigned subpage_reclaim(unsigned npages);
+
 ////////////////////////////////////////
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
  * This is a struct type for such a page.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 170 pagerefs, of which the bitmap below
+ * covers 160; they can manage up to 160 * 4K = 640K of kernel heap.
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
@@ -190,6 +335,7 @@ struct pagerefpage {
  */
 
 #define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
+#define PAGEREFS_PER_ROOT (INUSE_WORDS * 32)
 
 struct kheap_root {
 	struct pagerefpage *page;
@@ -198,22 +344,116 @@ struct kheap_root {
 };
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
+ * The roots live in chunks on a list. The first chunk is a small
+ * static array, which is enough for the kmallocs done early in boot.
+ * kheap_bootstrap then adds a chunk big enough for a heap the size of
+ * RAM, while alloc_kpages can still give it contiguous pages. If the
+ * roots ever run out anyway, allocpageref adds a chunk of one page,
+ * which is all alloc_kpages hands out after boot.
+ *
+ * Chunks are never freed, so roots never move.
+ */
+
+struct kheap_rootchunk {
+	struct kheap_rootchunk *next;
+	unsigned nroots;
+	struct kheap_root *roots;
+};
+
+#define NUM_BOOTROOTS 4
+
+static struct kheap_root kheaproots_boot[NUM_BOOTROOTS];
+static struct kheap_rootchunk kheaprootchunk_boot = {
+	NULL, NUM_BOOTROOTS, kheaproots_boot
+};
+static struct kheap_rootchunk *kheaprootchunks = &kheaprootchunk_boot;
+static struct kheap_rootchunk *kheaprootchunks_tail = &kheaprootchunk_boot;
+static unsigned nkheaproots = NUM_BOOTROOTS;
+
+/* Loop over every root, ROOT, using CHUNK and I as the cursor. */
+#define FOREACH_ROOT(chunk, i, root) \
+	for (chunk = kheaprootchunks; chunk != NULL; chunk = chunk->next) \
+		for (i = 0; i < chunk->nroots && \
+			    (root = &chunk->roots[i], true); i++)
+
+#define TOTAL_PAGEREFS (nkheaproots * PAGEREFS_PER_ROOT)
+
+/*
+ * Index of the lowest clear bit in WORD, which must not be all ones.
+ * Isolate the bit and count leading zeros, which MIPS32 does in one
+ * instruction.
+ */
+static
+inline
+unsigned
+findfirstzero(uint32_t word)
+{
+	KASSERT(word != 0xffffffff);
+	return 31 - __builtin_clz(~word & (word + 1));
+}
+
+/*
+ * Add a chunk of roots so that there are at least WANTED in all.
+ * Returns false if we're out of memory.
  *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * Call with kmalloc_spinlock held. We release it while calling
+ * alloc_kpages and free_kpages, as in allocpagerefpage below.
  */
+static
+bool
+growroots(unsigned wanted)
+{
+	struct kheap_rootchunk *chunk;
+	unsigned npages, oldnroots, i, j;
+	vaddr_t va;
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (nkheaproots >= wanted) {
+		return true;
+	}
+	oldnroots = nkheaproots;
+	npages = DIVROUNDUP(sizeof(struct kheap_rootchunk) +
+			    (wanted - nkheaproots) * sizeof(struct kheap_root),
+			    PAGE_SIZE);
+	spinlock_release(&kmalloc_spinlock);
+	va = alloc_kpages(npages);
+	spinlock_acquire(&kmalloc_spinlock);
+	if (va == 0) {
+		kprintf("kmalloc: Couldn't grow the pageref roots\n");
+		return false;
+	}
+	if (nkheaproots != oldnroots) {
+		/* Somebody else did it meanwhile. */
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(va);
+		spinlock_acquire(&kmalloc_spinlock);
+		return true;
+	}
+
+	/* Use up the whole pages. */
+	chunk = (struct kheap_rootchunk *)va;
+	chunk->next = NULL;
+	chunk->nroots = (npages * PAGE_SIZE - sizeof(*chunk)) /
+		sizeof(struct kheap_root);
+	chunk->roots = (struct kheap_root *)(chunk + 1);
+	for (i=0; i<chunk->nroots; i++) {
+		chunk->roots[i].page = NULL;
+		for (j=0; j<INUSE_WORDS; j++) {
+			chunk->roots[i].pagerefs_inuse[j] = 0;
+		}
+		chunk->roots[i].numinuse = 0;
+	}
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+	kheaprootchunks_tail->next = chunk;
+	kheaprootchunks_tail = chunk;
+	nkheaproots += chunk->nroots;
+	kheap_npages += npages;
+	return true;
+}
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a page to hold pagerefs for ROOT.
  */
 static
 void
@@ -242,12 +482,71 @@ allocpagerefpage(struct kheap_root *root)
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(va);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
+		/*
+		 * kheap_reclaim only frees pages with no pagerefs in
+		 * use, and our caller holds one.
+		 */
 		KASSERT(root->page != NULL);
 		return;
 	}
 
 	root->page = (struct pagerefpage *)va;
+	kheap_npages++;
+}
+
+/*
+ * Give back up to NPAGES pages: the cached empty heap pages, then,
+ * if that isn't enough, those that become empty when every cpu's
+ * magazines are emptied, and then the pageref pages that have no
+ * pagerefs in use. Returns the number of pages freed.
+ */
+static
+unsigned
+kheap_reclaim_upto(unsigned npages)
+{
+	struct kheap_rootchunk *chunk;
+	struct kheap_root *root;
+	unsigned i, freed;
+	vaddr_t va;
+
+	freed = subpage_reclaim(npages);
+#ifdef MAGAZINES
+	if (freed < npages) {
+		/* Cached blocks can pin otherwise empty pages. */
+		mag_flush();
+		freed += subpage_reclaim(npages - freed);
+	}
+#endif
+
+	/* And empty pages pin their pagerefs. */
+	spinlock_acquire(&kmalloc_spinlock);
+	FOREACH_ROOT(chunk, i, root) {
+		if (freed >= npages) {
+			break;
+		}
+		if (root->page == NULL || root->numinuse > 0) {
+			continue;
+		}
+		va = (vaddr_t)root->page;
+		root->page = NULL;
+		kheap_npages--;
+		/* Call free_kpages without kmalloc_spinlock. */
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(va);
+		spinlock_acquire(&kmalloc_spinlock);
+		freed++;
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return freed;
+}
+
+/*
+ * Give back everything kheap_reclaim_upto can.
+ */
+unsigned
+kheap_reclaim(void)
+{
+	return kheap_reclaim_upto((unsigned)-1);
 }
 
 /*
@@ -257,43 +556,44 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
+	unsigned i,j,n;
 	uint32_t k;
-	unsigned whichroot;
+	struct kheap_rootchunk *chunk;
 	struct kheap_root *root;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
+ again:
+	FOREACH_ROOT(chunk, n, root) {
+		if (root->numinuse >= PAGEREFS_PER_ROOT) {
 			continue;
 		}
 
-		/*
-		 * This should probably not be a linear search.
-		 */
 		for (i=0; i<INUSE_WORDS; i++) {
 			if (root->pagerefs_inuse[i]==0xffffffff) {
 				/* full */
 				continue;
 			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
+			j = findfirstzero(root->pagerefs_inuse[i]);
+			k = ((uint32_t)1) << j;
+			root->pagerefs_inuse[i] |= k;
+			root->numinuse++;
+			if (root->page == NULL) {
+				allocpagerefpage(root);
 			}
-			KASSERT(0);
+			if (root->page == NULL) {
+				/* Give the entry back. */
+				root->pagerefs_inuse[i] &= ~k;
+				root->numinuse--;
+				return NULL;
+			}
+			return &root->page->refs[i*32 + j];
 		}
+		KASSERT(0);
 	}
 
-	/* ran out */
+	/* ran out; get another page of roots */
+	if (growroots(nkheaproots + 1)) {
+		goto again;
+	}
 	return NULL;
 }
 
@@ -306,13 +606,12 @@ freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
+	unsigned n;
+	struct kheap_rootchunk *chunk;
 	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
+	FOREACH_ROOT(chunk, n, root) {
 		page = root->page;
 		if (page == NULL) {
 			KASSERT(root->numinuse == 0);
@@ -341,9 +640,108 @@ freepageref(struct pageref *p)
 /*
  * Each pageref is on two linked lists: one list of pages of blocks of
  * that same size, and one of all blocks.
+ *
+ * The pages of each size are kept on three lists, by how full they
+ * are, so that allocating never has to step over full pages. Pages
+ * that become entirely free are kept on the empty list, up to
+ * KHEAP_MAXEMPTY of them over all sizes, and freed beyond that; this
+ * saves going back to alloc_kpages when the heap goes up and down
+ * around a page boundary. kheap_reclaim frees them all.
  */
-static struct pageref *sizebases[NSIZES];
+#define SB_PARTIAL 0	/* some blocks free */
+#define SB_FULL    1	/* no blocks free */
+#define SB_EMPTY   2	/* all blocks free */
+#define SB_NLISTS  3
+
+#define KHEAP_MAXEMPTY 8
+
+static struct pageref *sizebases[NSIZES][SB_NLISTS];
 static struct pageref *allbase;
+static unsigned kheap_nempty;	/* pages on the SB_EMPTY lists */
+
+/*
+ * Shrinker for the heap: what kheap_reclaim would free, not counting
+ * pages pinned only by blocks in the magazines.
+ */
+static
+unsigned
+kheap_shrink_count(void *data)
+{
+	struct kheap_rootchunk *chunk;
+	struct kheap_root *root;
+	unsigned i, n;
+
+	(void)data;
+	spinlock_acquire(&kmalloc_spinlock);
+	n = kheap_nempty;
+	FOREACH_ROOT(chunk, i, root) {
+		if (root->page != NULL && root->numinuse == 0) {
+			n++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return n;
+}
+
+static
+unsigned
+kheap_shrink_scan(void *data, unsigned npages)
+{
+	(void)data;
+	return kheap_reclaim_upto(npages);
+}
+
+static struct shrinker kheap_shrinker = {
+	.sh_name = "kheap",
+	.sh_count = kheap_shrink_count,
+	.sh_scan = kheap_shrink_scan,
+	.sh_data = NULL,
+};
+
+/*
+ * Size the root array and kheap_pagerefs for all of RAM. This is
+ * called from vm_bootstrap before the frame table is set up, while
+ * alloc_kpages still steals contiguous memory; afterwards it only
+ * hands out single pages.
+ */
+void
+kheap_bootstrap(void)
+{
+	struct pageref **table, *pr;
+	unsigned rampages, i;
+	vaddr_t va;
+
+	rampages = ram_getsize() / PAGE_SIZE;
+
+	va = alloc_kpages(DIVROUNDUP(rampages * sizeof(struct pageref *),
+				     PAGE_SIZE));
+	if (va == 0) {
+		panic("kheap_bootstrap: Out of memory\n");
+	}
+	table = (struct pageref **)va;
+	for (i=0; i<rampages; i++) {
+		table[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (!growroots(DIVROUNDUP(rampages, PAGEREFS_PER_ROOT))) {
+		panic("kheap_bootstrap: Out of memory\n");
+	}
+
+	/* Record the heap pages we already have. */
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		i = KVADDR_TO_PADDR(PR_PAGEADDR(pr)) / PAGE_SIZE;
+		KASSERT(i < rampages);
+		table[i] = pr;
+	}
+	kheap_pagerefs = table;
+	/* kfree reads these without the lock; publish the table first. */
+	membar_store_store();
+	kheap_maxpages = rampages;
+	spinlock_release(&kmalloc_spinlock);
+
+	shrinker_register(&kheap_shrinker);
+}
 
 ////////////////////////////////////////
 
@@ -580,16 +978,19 @@ void
 checksubpages(void)
 {
 	struct pageref *pr;
-	int i;
+	int i, l;
 	unsigned sc=0, ac=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
-			sc++;
+		for (l=0; l<SB_NLISTS; l++) {
+			for (pr = sizebases[i][l]; pr != NULL;
+			     pr = pr->next_samesize) {
+				checksubpage(pr);
+				KASSERT(sc < TOTAL_PAGEREFS);
+				sc++;
+			}
 		}
 	}
 
@@ -681,12 +1082,15 @@ void
 dump_subpages(unsigned generation)
 {
 	struct pageref *pr;
-	int i;
+	int i, l;
 
 	kprintf("Remaining allocations from generation %u:\n", generation);
 	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			dump_subpage(pr, generation);
+		for (l=0; l<SB_NLISTS; l++) {
+			for (pr = sizebases[i][l]; pr != NULL;
+			     pr = pr->next_samesize) {
+				dump_subpage(pr, generation);
+			}
 		}
 	}
 }
@@ -794,6 +1198,75 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Print how much of the heap pages is actually asked for. For each
+ * block size: the pages, the blocks in use, and the requests since
+ * boot with their average size. The average gives the internal
+ * fragmentation (block space not asked for); the free blocks and the
+ * tail of each page that no block fits in make up the rest.
+ */
+static
+void
+subpage_fragstats(void)
+{
+	struct pageref *pr;
+	unsigned blktype, l, cpu, npages, perpage, nfree, inuse, nreqs;
+	unsigned avgreq, waste;
+	uint64_t reqbytes, heapbytes = 0, blockbytes = 0, usedbytes = 0;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	kprintf("Fragmentation%s:\n",
+#ifdef MAGAZINES
+		" (blocks in magazines count as in use)"
+#else
+		""
+#endif
+		);
+	kprintf("  size  pages  inuse   free  requests  avgreq  waste%%\n");
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		npages = nfree = 0;
+		for (l=0; l<SB_NLISTS; l++) {
+			for (pr = sizebases[blktype][l]; pr != NULL;
+			     pr = pr->next_samesize) {
+				npages++;
+				nfree += pr->nfree;
+			}
+		}
+		perpage = PAGE_SIZE / sizes[blktype];
+		inuse = npages * perpage - nfree;
+
+		nreqs = 0;
+		reqbytes = 0;
+		for (cpu=0; cpu<VM_MAXCPUS; cpu++) {
+			nreqs += kheap_reqstats[cpu][blktype].rs_count;
+			reqbytes += kheap_reqstats[cpu][blktype].rs_bytes;
+		}
+		if (npages == 0 && nreqs == 0) {
+			continue;
+		}
+		avgreq = nreqs ? (unsigned)(reqbytes / nreqs) : 0;
+		waste = nreqs ? 100 - (avgreq * 100) / sizes[blktype] : 0;
+
+		kprintf("  %4lu %6u %6u %6u %9u %7u %6u\n",
+			(unsigned long)sizes[blktype], npages, inuse, nfree,
+			nreqs, avgreq, waste);
+
+		heapbytes += (uint64_t)npages * PAGE_SIZE;
+		blockbytes += (uint64_t)inuse * sizes[blktype];
+		usedbytes += (uint64_t)inuse * avgreq;
+	}
+	if (heapbytes == 0) {
+		return;
+	}
+	kprintf("  %u empty pages cached\n", kheap_nempty);
+	kprintf("  heap %lu bytes, blocks in use %lu, requested about %lu: "
+		"%u%% overhead\n",
+		(unsigned long)heapbytes, (unsigned long)blockbytes,
+		(unsigned long)usedbytes,
+		(unsigned)(100 - (usedbytes * 100) / heapbytes));
+}
+
 /*
  * Print the whole heap.
  */
@@ -811,11 +1284,62 @@ kheap_printstats(void)
 		subpage_stats(pr);
 	}
 
+	subpage_fragstats();
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Return the number of pages kmalloc is holding: the subpage
+ * allocator's and those of whole-page blocks.
+ */
+unsigned
+kheap_pagesinuse(void)
+{
+	unsigned n;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	n = kheap_npages + kheap_nlargepages;
 	spinlock_release(&kmalloc_spinlock);
+	return n;
 }
 
 ////////////////////////////////////////
 
+/*
+ * Put a pageref on the front of one of the lists of its size.
+ */
+static
+void
+samesize_push(struct pageref *pr, int blktype, int list)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(list>=0 && list<SB_NLISTS);
+
+	pr->next_samesize = sizebases[blktype][list];
+	pr->prev_samesize = &sizebases[blktype][list];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
+	}
+	sizebases[blktype][list] = pr;
+}
+
+/*
+ * Take a pageref off whichever list of its size it's on.
+ */
+static
+void
+samesize_remove(struct pageref *pr)
+{
+	KASSERT(*pr->prev_samesize == pr);
+
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		checksubpage(pr->next_samesize);
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+}
+
 /*
  * Remove a pageref from both lists that it's on.
  */
@@ -823,24 +1347,15 @@ static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(*pr->prev_all == pr);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
-	}
+	samesize_remove(pr);
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		checksubpage(pr->next_all);
+		pr->next_all->prev_all = pr->prev_all;
 	}
 }
 
@@ -853,122 +1368,105 @@ inline
 int blocktype(size_t clientsz)
 {
 	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (clientsz <= sizes[i]) {
-			return i;
-		}
-	}
-
-	panic("Subpage allocator cannot handle allocation of size %zu\n",
-	      clientsz);
 
-	// keep compiler happy
-	return 0;
+	if (clientsz > LARGEST_SUBPAGE_SIZE) {
+		panic("Subpage allocator cannot handle allocation of size %zu\n",
+		      clientsz);
+	}
+	i = sizeindex[DIVROUNDUP(clientsz, SIZEINDEX_UNIT)];
+#ifdef SLOW
+	KASSERT(clientsz <= sizes[i]);
+	KASSERT(i == 0 || clientsz > sizes[i-1]);
+#endif
+	return i;
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take a free block off one of the pages of block type BLKTYPE: the
+ * first partly used page, or else a cached empty one. Returns NULL if
+ * there is neither.
+ *
+ * Call with kmalloc_spinlock held.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_takeblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-#ifdef GUARDS
-	size_t clientsz;
-#endif
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
-
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
-
-		if (pr->nfree > 0) {
+	pr = sizebases[blktype][SB_PARTIAL];
+	if (pr == NULL) {
+		pr = sizebases[blktype][SB_EMPTY];
+		if (pr == NULL) {
+			return NULL;
+		}
+		samesize_remove(pr);
+		samesize_push(pr, blktype, SB_PARTIAL);
+		KASSERT(kheap_nempty > 0);
+		kheap_nempty--;
+	}
 
-		doalloc: /* comes here after getting a whole fresh page */
+	/* check for corruption */
+	KASSERT(PR_BLOCKTYPE(pr) == blktype);
+	checksubpage(pr);
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-			checksubpages();
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		samesize_remove(pr);
+		samesize_push(pr, blktype, SB_FULL);
 	}
+	return retptr;
+}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
+/*
+ * Make a fresh page of block type BLKTYPE and put it on the lists.
+ * Returns false if we're out of memory.
+ *
+ * Call with kmalloc_spinlock held. We release the spinlock while
+ * calling alloc_kpages. This avoids deadlock if alloc_kpages needs
+ * to come back here. Note that this means things can change behind
+ * our back...
+ */
+static
+bool
+subpage_addpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	volatile int i;
 
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
@@ -983,7 +1481,8 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -1007,88 +1506,136 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	samesize_push(pr, blktype, SB_PARTIAL);
 
 	pr->next_all = allbase;
+	pr->prev_all = &allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = &pr->next_all;
+	}
 	allbase = pr;
+	kheap_npages++;
+	setpageref(prpage, pr);
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	return true;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
  */
 static
-int
-subpage_kfree(void *ptr)
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+
 #ifdef GUARDS
-	size_t blocksize, smallerblocksize;
+	size_t clientsz;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
 #endif
 #ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
 #endif
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
+	/*
+	 * If no page of the right size has a free block, make a new
+	 * one; it goes on the front of the list, so the next try
+	 * finds it.
+	 */
+	while ((retptr = subpage_takeblock(blktype)) == NULL) {
+		if (!subpage_addpage(blktype)) {
+			spinlock_release(&kmalloc_spinlock);
+			return NULL;
+		}
+	}
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	checksubpages();
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
+}
+
+/*
+ * Put the block at PTRADDR back on the freelist of its page. If the
+ * pointer is not on any heap page we recognize, return -1. If the
+ * page becomes entirely free it is taken off the lists and its
+ * address is returned in *FREEPAGE, for the caller to free_kpages
+ * once it has released the lock; otherwise *FREEPAGE is 0. PTR is
+ * the client pointer, for error messages.
+ *
+ * Call with kmalloc_spinlock held.
+ */
+static
+int
+subpage_putblock(vaddr_t ptraddr, void *ptr, vaddr_t *freepage)
+{
+	int blktype;		// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	*freepage = 0;
+
+	pr = getpageref(ptraddr);
+	if (pr == NULL && ptraddr >= MIPS_KSEG0 &&
+	    KVADDR_TO_PADDR(ptraddr) / PAGE_SIZE >= kheap_maxpages) {
+		/* Past the end of kheap_pagerefs; search for it. */
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
+			}
 		}
 	}
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1135,19 +1682,115 @@ subpage_kfree(void *ptr)
 #endif
 	}
 	pr->freelist_offset = offset;
+	if (pr->nfree == 0) {
+		/* No longer full. */
+		samesize_remove(pr);
+		samesize_push(pr, blktype, SB_PARTIAL);
+	}
 	pr->nfree++;
 
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		/* Whole page is free. Keep it, or give it back. */
+		if (kheap_nempty < KHEAP_MAXEMPTY) {
+			samesize_remove(pr);
+			samesize_push(pr, blktype, SB_EMPTY);
+			kheap_nempty++;
+		}
+		else {
+			remove_lists(pr, blktype);
+			freepageref(pr);
+			kheap_npages--;
+			setpageref(prpage, NULL);
+			*freepage = prpage;
+		}
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
+/*
+ * Give back up to NPAGES of the empty pages kept on the SB_EMPTY
+ * lists. Returns how many were freed.
+ */
+static
+unsigned
+subpage_reclaim(unsigned npages)
+{
+	struct pageref *pr;
+	unsigned blktype, freed = 0;
+	vaddr_t prpage;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (blktype=0; blktype < NSIZES; blktype++) {
+		while (freed < npages &&
+		       (pr = sizebases[blktype][SB_EMPTY]) != NULL) {
+			KASSERT(pr->nfree == PAGE_SIZE / sizes[blktype]);
+			prpage = PR_PAGEADDR(pr);
+			remove_lists(pr, blktype);
+			freepageref(pr);
+			kheap_npages--;
+			setpageref(prpage, NULL);
+			KASSERT(kheap_nempty > 0);
+			kheap_nempty--;
+
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(prpage);
+			spinlock_acquire(&kmalloc_spinlock);
+			freed++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return freed;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t freepage;	// page to give back, if it became empty
+	int result;
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	result = subpage_putblock(ptraddr, ptr, &freepage);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1156,6 +1799,595 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
+	return result;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+#ifdef MAGAZINES
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a small stack of free blocks (a magazine) for each
+ * block size, in front of the page freelists. kmalloc and kfree only
+ * touch the magazines of the cpu they run on, under that cpu's own
+ * mag_locks entry, so most calls don't need kmalloc_spinlock at all.
+ * An empty magazine is refilled, and a full one half emptied,
+ * MAG_BATCH blocks at a time under one acquisition of
+ * kmalloc_spinlock.
+ *
+ * Blocks sitting in magazines look allocated to the rest of this
+ * file (kheap_printstats, checksubpages), and they keep their page
+ * from being freed. kheap_reclaim empties the magazines of every
+ * cpu; that is the only time a cpu's magazine lock is contended.
+ */
+
+#define MAG_ROUNDS 16	/* blocks a magazine can hold */
+#define MAG_BATCH 8	/* blocks moved to or from the pages at once */
+
+struct magazine {
+	unsigned rounds;		/* number of blocks in blocks[] */
+	void *blocks[MAG_ROUNDS];
+};
+
+static struct magazine magazines[VM_MAXCPUS][NSIZES];
+static struct spinlock mag_locks[VM_MAXCPUS] = {
+	[0 ... VM_MAXCPUS - 1] = SPINLOCK_INITIALIZER
+};
+
+/*
+ * Lock the current cpu's magazines and return its number, or -1 (and
+ * nothing locked) if there are no cpus yet (early boot) or too many.
+ * If we migrate before the lock is taken we just use the magazines
+ * of the cpu we started on, which is fine since they're locked.
+ */
+static
+int
+mag_lock(void)
+{
+	unsigned cpunum;
+
+	if (!CURCPU_EXISTS()) {
+		return -1;
+	}
+	cpunum = curcpu->c_number;
+	if (cpunum >= VM_MAXCPUS) {
+		return -1;
+	}
+	spinlock_acquire(&mag_locks[cpunum]);
+	return cpunum;
+}
+
+/*
+ * Give N blocks back to their pages, under one acquisition of the
+ * lock.
+ */
+static
+void
+mag_putbatch(void **blocks, unsigned n)
+{
+	vaddr_t freepages[MAG_BATCH + 1];
+	unsigned i, nfreepages = 0;
+	int result;
+
+	KASSERT(n <= MAG_BATCH + 1);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		result = subpage_putblock((vaddr_t)blocks[i], blocks[i],
+					  &freepages[nfreepages]);
+		KASSERT(result == 0);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from the current cpu's magazine,
+ * refilling it if it's empty.
+ */
+static
+void *
+mag_kmalloc(unsigned blktype)
+{
+	struct magazine *mag;
+	void *batch[MAG_BATCH];
+	void *retptr;
+	unsigned i, n;
+	int cpunum;
+
+	cpunum = mag_lock();
+	if (cpunum >= 0) {
+		mag = &magazines[cpunum][blktype];
+		if (mag->rounds > 0) {
+			retptr = mag->blocks[--mag->rounds];
+			spinlock_release(&mag_locks[cpunum]);
+			return retptr;
+		}
+		spinlock_release(&mag_locks[cpunum]);
+	}
+
+	/* Empty: take a batch off the pages. */
+	spinlock_acquire(&kmalloc_spinlock);
+	n = 0;
+	while (n < MAG_BATCH) {
+		batch[n] = subpage_takeblock(blktype);
+		if (batch[n] != NULL) {
+			n++;
+			continue;
+		}
+		/*
+		 * Only get a new page if we have nothing at all yet, and
+		 * then try again without counting the failed take.
+		 */
+		if (n > 0 || !subpage_addpage(blktype)) {
+			break;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	if (n == 0) {
+		return NULL;
+	}
+
+	/*
+	 * Keep the first block for ourselves; the rest goes in the
+	 * magazine of whatever cpu we're on now. If that one filled up
+	 * meanwhile, give the leftovers back.
+	 */
+	retptr = batch[0];
+	i = 1;
+	cpunum = mag_lock();
+	if (cpunum >= 0) {
+		mag = &magazines[cpunum][blktype];
+		for (; i<n && mag->rounds < MAG_ROUNDS; i++) {
+			mag->blocks[mag->rounds++] = batch[i];
+		}
+		spinlock_release(&mag_locks[cpunum]);
+	}
+	if (i < n) {
+		mag_putbatch(&batch[i], n - i);
+	}
+	return retptr;
+}
+
+/*
+ * Free a block of type BLKTYPE into the current cpu's magazine; if it
+ * is full, move the block and MAG_BATCH others back to their pages.
+ */
+static
+void
+mag_kfree(void *ptr, unsigned blktype)
+{
+	struct magazine *mag;
+	void *batch[MAG_BATCH + 1];
+	unsigned n = 0;
+	int cpunum;
+
+	/* As for subpage_kfree, to catch uses of dangling pointers. */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	batch[n++] = ptr;
+	cpunum = mag_lock();
+	if (cpunum >= 0) {
+		mag = &magazines[cpunum][blktype];
+		if (mag->rounds < MAG_ROUNDS) {
+			mag->blocks[mag->rounds++] = ptr;
+			spinlock_release(&mag_locks[cpunum]);
+			return;
+		}
+		while (n <= MAG_BATCH && mag->rounds > 0) {
+			batch[n++] = mag->blocks[--mag->rounds];
+		}
+		spinlock_release(&mag_locks[cpunum]);
+	}
+
+	mag_putbatch(batch, n);
+}
+
+/*
+ * Empty all the magazines of every cpu. The blocks cached on other
+ * cpus pin pages just as much as ours do, so under memory pressure
+ * they all have to go.
+ */
+static
+void
+mag_flush(void)
+{
+	struct magazine *mag;
+	void *batch[MAG_BATCH];
+	unsigned cpunum, blktype, n;
+
+	for (cpunum=0; cpunum<VM_MAXCPUS; cpunum++) {
+		for (blktype=0; blktype<NSIZES; blktype++) {
+			mag = &magazines[cpunum][blktype];
+			do {
+				spinlock_acquire(&mag_locks[cpunum]);
+				for (n=0; mag->rounds > 0 && n < MAG_BATCH; n++) {
+					batch[n] = mag->blocks[--mag->rounds];
+				}
+				spinlock_release(&mag_locks[cpunum]);
+				if (n > 0) {
+					mag_putbatch(batch, n);
+				}
+			} while (n > 0);
+		}
+	}
+}
+
+#endif /* MAGAZINES */
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Allocation-site profiling.
+//
+// Unlike LABELS this is always compiled in and costs one test of
+// kprof_rate per kmalloc while off. With kheap_profile(N) every Nth
+// kmalloc on each cpu is sampled: its caller's address is looked up
+// in a small hash table of sites, which counts the sampled
+// allocations and bytes and the sampled bytes still live. To know
+// when a sampled block goes away, its address is also kept in a
+// table of live sampled blocks, and its heap page gets PR_SAMPLED so
+// that kfree only looks there for blocks on such pages (or for
+// whole-page blocks while any are being tracked). The page loses
+// PR_SAMPLED again when its last tracked block is freed. The reports
+// scale the counts by N, so they are estimates.
+//
+// As with LABELS, sites are return addresses; look them up in the
+// kernel image with nm or addr2line.
+//
+
+#define KPROF_NSITES  128	/* sites table size, power of two */
+#define KPROF_NBLOCKS 1024	/* live sampled blocks table, ditto */
+
+struct kprof_site {
+	vaddr_t ks_site;		/* 0 if unused */
+	unsigned ks_nallocs;
+	unsigned ks_nfrees;
+	uint64_t ks_bytes;		/* ever allocated */
+	unsigned ks_livebytes;
+};
+
+struct kprof_block {
+	vaddr_t kb_addr;		/* 0 if unused */
+	unsigned kb_size;
+	unsigned kb_site;		/* index into kprof_sites */
+};
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned kprof_rate;	/* 0 if off */
+static unsigned kprof_scale;		/* rate the data was taken at */
+static unsigned kprof_countdown[VM_MAXCPUS];
+static unsigned kfence_countdown[VM_MAXCPUS];
+static struct kprof_site kprof_sites[KPROF_NSITES];
+static struct kprof_block kprof_blocks[KPROF_NBLOCKS];
+static volatile unsigned kprof_nblocks;	/* live blocks tracked */
+static unsigned kprof_lost;		/* sites or blocks that didn't fit */
+
+#define KPROF_HASH(addr, n) ((((addr) >> 2) * 2654435761U) & ((n) - 1))
+
+/*
+ * Count down COUNTDOWN, a per-cpu array, and return true every RATEth
+ * time on each cpu. With interrupts off, so it takes no lock. Also
+ * used for kfence.
+ */
+static
+bool
+sampletick(unsigned *countdown, unsigned rate)
+{
+	unsigned cpunum = 0;
+	bool ret = false;
+	int spl;
+
+	spl = splhigh();
+	if (CURCPU_EXISTS()) {
+		cpunum = curcpu->c_number;
+	}
+	if (cpunum < VM_MAXCPUS && rate != 0) {
+		if (countdown[cpunum] == 0 || countdown[cpunum] > rate) {
+			countdown[cpunum] = rate;
+		}
+		if (--countdown[cpunum] == 0) {
+			ret = true;
+		}
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Find or make the sites table entry for SITE. Returns KPROF_NSITES
+ * if the table is full. Call with kprof_lock held.
+ */
+static
+unsigned
+kprof_findsite(vaddr_t site)
+{
+	unsigned i, n;
+
+	i = KPROF_HASH(site, KPROF_NSITES);
+	for (n=0; n<KPROF_NSITES; n++) {
+		if (kprof_sites[i].ks_site == site) {
+			return i;
+		}
+		if (kprof_sites[i].ks_site == 0) {
+			kprof_sites[i].ks_site = site;
+			return i;
+		}
+		i = (i + 1) & (KPROF_NSITES - 1);
+	}
+	return KPROF_NSITES;
+}
+
+/*
+ * Set or clear PR_SAMPLED on the heap page of PTR, if it has one.
+ * Call with kprof_lock held, so that marking and unmarking a page
+ * follow the blocks table.
+ */
+static
+void
+kprof_markpage(void *ptr, bool sampled)
+{
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = getpageref((vaddr_t)ptr);
+	if (pr != NULL) {
+		if (sampled) {
+			pr->pageaddr_and_blocktype |= PR_SAMPLED;
+		}
+		else {
+			pr->pageaddr_and_blocktype &= ~PR_SAMPLED;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Record a sampled allocation of SZ bytes at PTR from SITE.
+ */
+static
+void
+kprof_sample(void *ptr, size_t sz, vaddr_t site)
+{
+	unsigned s, i, n;
+
+	spinlock_acquire(&kprof_lock);
+	s = kprof_findsite(site);
+	if (s == KPROF_NSITES) {
+		kprof_lost++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	kprof_sites[s].ks_nallocs++;
+	kprof_sites[s].ks_bytes += sz;
+
+	i = KPROF_HASH((vaddr_t)ptr, KPROF_NBLOCKS);
+	for (n=0; n<KPROF_NBLOCKS; n++) {
+		if (kprof_blocks[i].kb_addr == 0) {
+			kprof_blocks[i].kb_addr = (vaddr_t)ptr;
+			kprof_blocks[i].kb_size = sz;
+			kprof_blocks[i].kb_site = s;
+			kprof_sites[s].ks_livebytes += sz;
+			kprof_nblocks++;
+			/* Mark the page so kfree knows to look for it. */
+			kprof_markpage(ptr, true);
+			spinlock_release(&kprof_lock);
+			return;
+		}
+		i = (i + 1) & (KPROF_NBLOCKS - 1);
+	}
+	/* Too many live blocks; this one's lifetime isn't tracked. */
+	kprof_lost++;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * PTR is being freed; if it's a sampled block, account for it. Must
+ * be called before the block is really freed, so that it can't have
+ * been handed out and sampled again.
+ */
+static
+void
+kprof_unsample(void *ptr)
+{
+	unsigned i, j, k, n;
+
+	spinlock_acquire(&kprof_lock);
+	i = KPROF_HASH((vaddr_t)ptr, KPROF_NBLOCKS);
+	for (n=0; n<KPROF_NBLOCKS; n++) {
+		if (kprof_blocks[i].kb_addr == 0) {
+			/* not sampled */
+			spinlock_release(&kprof_lock);
+			return;
+		}
+		if (kprof_blocks[i].kb_addr == (vaddr_t)ptr) {
+			break;
+		}
+		i = (i + 1) & (KPROF_NBLOCKS - 1);
+	}
+	if (n == KPROF_NBLOCKS) {
+		spinlock_release(&kprof_lock);
+		return;
+	}
+
+	k = kprof_blocks[i].kb_site;
+	kprof_sites[k].ks_nfrees++;
+	kprof_sites[k].ks_livebytes -= kprof_blocks[i].kb_size;
+	kprof_nblocks--;
+
+	/*
+	 * Take it out of the linear probe sequence: move up any later
+	 * entry that can't be found anymore across the hole.
+	 */
+	kprof_blocks[i].kb_addr = 0;
+	j = i;
+	while (1) {
+		j = (j + 1) & (KPROF_NBLOCKS - 1);
+		if (kprof_blocks[j].kb_addr == 0) {
+			break;
+		}
+		k = KPROF_HASH(kprof_blocks[j].kb_addr, KPROF_NBLOCKS);
+		/* Leave it if its home is cyclically in (i, j]. */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		kprof_blocks[i] = kprof_blocks[j];
+		kprof_blocks[j].kb_addr = 0;
+		i = j;
+	}
+
+	/* If that was the last tracked block on its page, unmark it. */
+	for (i=0; i<KPROF_NBLOCKS; i++) {
+		if (kprof_blocks[i].kb_addr != 0 &&
+		    (kprof_blocks[i].kb_addr & PAGE_FRAME) ==
+		    ((vaddr_t)ptr & PAGE_FRAME)) {
+			break;
+		}
+	}
+	if (i == KPROF_NBLOCKS) {
+		kprof_markpage(ptr, false);
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Start sampling every RATEth kmalloc, throwing away what has been
+ * collected so far, or stop sampling if RATE is 0. Frees of sampled
+ * blocks are still counted after stopping.
+ */
+void
+kheap_profile(unsigned rate)
+{
+	unsigned i;
+
+	spinlock_acquire(&kprof_lock);
+	kprof_rate = 0;
+	if (rate == 0) {
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	for (i=0; i<KPROF_NSITES; i++) {
+		kprof_sites[i].ks_site = 0;
+		kprof_sites[i].ks_nallocs = 0;
+		kprof_sites[i].ks_nfrees = 0;
+		kprof_sites[i].ks_bytes = 0;
+		kprof_sites[i].ks_livebytes = 0;
+	}
+	for (i=0; i<KPROF_NBLOCKS; i++) {
+		if (kprof_blocks[i].kb_addr != 0) {
+			kprof_markpage((void *)kprof_blocks[i].kb_addr, false);
+		}
+		kprof_blocks[i].kb_addr = 0;
+	}
+	kprof_nblocks = 0;
+	kprof_lost = 0;
+	kprof_scale = rate;
+	kprof_rate = rate;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the N sites with the most live bytes.
+ */
+void
+kheap_profile_report(unsigned n)
+{
+	bool done[KPROF_NSITES];
+	unsigned i, best, rank, rate;
+
+	spinlock_acquire(&kprof_lock);
+	rate = kprof_scale;
+	if (rate == 0) {
+		spinlock_release(&kprof_lock);
+		kprintf("kmalloc profiling has not been started\n");
+		return;
+	}
+	kprintf("kmalloc sites, 1 in %u allocations sampled%s, "
+		"scaled estimates:\n", rate,
+		kprof_rate == 0 ? " (stopped)" : "");
+	kprintf("  site          live bytes     allocs      frees"
+		"   avg size\n");
+	for (i=0; i<KPROF_NSITES; i++) {
+		done[i] = false;
+	}
+	for (rank=0; rank<n; rank++) {
+		best = KPROF_NSITES;
+		for (i=0; i<KPROF_NSITES; i++) {
+			if (done[i] || kprof_sites[i].ks_site == 0) {
+				continue;
+			}
+			if (best == KPROF_NSITES ||
+			    kprof_sites[i].ks_livebytes >
+			    kprof_sites[best].ks_livebytes) {
+				best = i;
+			}
+		}
+		if (best == KPROF_NSITES) {
+			break;
+		}
+		done[best] = true;
+		kprintf("  0x%08lx %12lu %10lu %10lu %10lu\n",
+			(unsigned long)kprof_sites[best].ks_site,
+			(unsigned long)kprof_sites[best].ks_livebytes * rate,
+			(unsigned long)kprof_sites[best].ks_nallocs * rate,
+			(unsigned long)kprof_sites[best].ks_nfrees * rate,
+			(unsigned long)(kprof_sites[best].ks_bytes /
+					kprof_sites[best].ks_nallocs));
+	}
+	if (kprof_lost > 0) {
+		kprintf("  (%u samples didn't fit in the tables)\n",
+			kprof_lost);
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Kernel menu command:
+ *    kprof N   - sample every Nth allocation (0 turns it off)
+ *    kprof     - print the top 10 sites
+ *    kprof top N - print the top N sites
+ */
+int
+kheap_profile_menu(int nargs, char **args)
+{
+	int n;
+
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n < 0) {
+			kprintf("kprof: The rate can't be negative\n");
+			return EINVAL;
+		}
+		kheap_profile(n);
+		return 0;
+	}
+	if (nargs == 3 && !strcmp(args[1], "top")) {
+		n = atoi(args[2]);
+		if (n < 0) {
+			kprintf("kprof: The count can't be negative\n");
+			return EINVAL;
+		}
+		kheap_profile_report(n);
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: kprof [rate | top n]\n");
+		return EINVAL;
+	}
+	kheap_profile_report(10);
 	return 0;
 }
 
@@ -1163,27 +2395,35 @@ subpage_kfree(void *ptr)
 ////////////////////////////////////////////////////////////
 
 /*
- * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * Allocate a block of size SZ for the caller at SITE. Redirect either
+ * to subpage_kmalloc or alloc_kpages depending on how big SZ is. If
+ * FENCE, the block may be sampled for kfence.
+ *
+ * kfence blocks are in kseg2 and need the TLB, so a block the size
+ * of a page (a thread stack) is never sampled: the exception path
+ * can't take a TLB miss on its own stack.
  */
+static
+inline
 void *
-kmalloc(size_t sz)
+kmalloc_site(size_t sz, vaddr_t site, bool fence)
 {
 	size_t checksz;
-#ifdef LABELS
-	vaddr_t label;
-#endif
-
-#ifdef LABELS
-#ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
-#else
-#error "Don't know how to get return address with this compiler"
-#endif /* __GNUC__ */
-#endif /* LABELS */
+	unsigned blktype;
+	void *ptr;
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+	ptr = NULL;
+	if (fence && kfence_rate != 0 && sz > 0 && sz < PAGE_SIZE &&
+	    sampletick(kfence_countdown, kfence_rate)) {
+		/* Use a guarded block if kfence has one free. */
+		ptr = kfence_alloc(sz, site);
+	}
+
+	if (ptr != NULL) {
+		/* got it */
+	}
+	else if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
@@ -1194,15 +2434,46 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+		spinlock_acquire(&kmalloc_spinlock);
+		kheap_nlargepages += npages;
+		spinlock_release(&kmalloc_spinlock);
 
-		return (void *)address;
+		ptr = (void *)address;
 	}
+	else {
+		blktype = blocktype(checksz);
+		countrequest(blktype, sz);
 
-#ifdef LABELS
-	return subpage_kmalloc(sz, label);
+#ifdef MAGAZINES
+		ptr = mag_kmalloc(blktype);
+#elif defined(LABELS)
+		ptr = subpage_kmalloc(sz, site);
 #else
-	return subpage_kmalloc(sz);
+		ptr = subpage_kmalloc(sz);
 #endif
+	}
+
+	if (kprof_rate != 0 && ptr != NULL &&
+	    sampletick(kprof_countdown, kprof_rate)) {
+		kprof_sample(ptr, sz, site);
+	}
+	return ptr;
+}
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_site(sz, (vaddr_t)__builtin_return_address(0), true);
+}
+
+/*
+ * kmalloc for memory the exception path touches (thread stacks,
+ * trapframes): never a kfence block.
+ */
+void *
+kmalloc_nofence(size_t sz)
+{
+	return kmalloc_site(sz, (vaddr_t)__builtin_return_address(0), false);
 }
 
 /*
@@ -1211,14 +2482,50 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+	struct pageref *pr;
+#ifdef MAGAZINES
+	int blktype;
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if (KFENCE_ISADDR(ptr)) {
+		if (kprof_nblocks > 0) {
+			kprof_unsample(ptr);
+		}
+		kfence_free(ptr, (vaddr_t)__builtin_return_address(0));
+		return;
+	}
+	pr = getpageref((vaddr_t)ptr);
+	if (pr != NULL && (pr->pageaddr_and_blocktype & PR_SAMPLED) != 0) {
+		kprof_unsample(ptr);
+	}
+#ifdef MAGAZINES
+	if (pr != NULL) {
+		blktype = PR_BLOCKTYPE(pr);
+		if (((vaddr_t)ptr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		mag_kfree(ptr, blktype);
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		if (kprof_nblocks > 0) {
+			kprof_unsample(ptr);
+		}
+		if (KVADDR_TO_PADDR((vaddr_t)ptr) > frametop) {
+			/* A frame, not memory stolen at boot; see above. */
+			spinlock_acquire(&kmalloc_spinlock);
+			KASSERT(kheap_nlargepages > 0);
+			kheap_nlargepages--;
+			spinlock_release(&kmalloc_spinlock);
+		}
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
@@ -0,0 +1,402 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include <shrinker.h>
+
+/*
+ * Object caches. See kmemcache.h.
+ *
+ * Each slab is one page from alloc_kpages. It starts with a struct
+ * kmem_slab, followed by the free index list (one entry per object),
+ * followed by the objects. Because the free list lives in the header
+ * and not in the objects, a free object keeps its constructed state.
+ * The slab of an object is found by rounding its address down to the
+ * page, so freeing never searches.
+ *
+ * A cache keeps the slabs that still have free objects on kc_slabs
+ * and the others on kc_full. At most KMEM_MAXEMPTY completely free
+ * slabs are kept around; more than that are destroyed and their pages
+ * given back. Each cache also registers a shrinker, so that under
+ * memory pressure even those go.
+ */
+
+#define KMEM_ALIGN    8
+#define KMEM_NONE     0xffff        /* end of a slab's free index list */
+#define KMEM_MAXEMPTY 1
+
+struct kmem_slab {
+    struct kmem_cache *ks_cache;
+    struct kmem_slab *ks_next;
+    struct kmem_slab **ks_prev;    /* whatever points at us */
+    unsigned ks_nfree;
+    uint16_t ks_freehead;           /* first free object, or KMEM_NONE */
+    uint16_t ks_freelist[];         /* next free object after each one */
+};
+
+struct kmem_cache {
+    char *kc_name;
+    size_t kc_size;                 /* object size, rounded up */
+    unsigned kc_perslab;            /* objects in each slab */
+    size_t kc_objoffset;            /* where the objects start in a slab */
+    int (*kc_ctor)(void *obj);
+    void (*kc_dtor)(void *obj);
+
+    struct spinlock kc_lock;        /* protects all of the below */
+    struct kmem_slab *kc_slabs;     /* slabs with free objects */
+    struct kmem_slab *kc_full;      /* slabs without */
+    unsigned kc_nempty;             /* completely free slabs on kc_slabs */
+    struct shrinker kc_shrinker;
+
+    /* statistics */
+    unsigned kc_nslabs;
+    unsigned kc_inuse;
+    unsigned kc_allocs;
+    unsigned kc_frees;
+    unsigned kc_failed;
+
+    struct kmem_cache *kc_next;     /* list of all caches */
+};
+
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+#define SLAB_OBJ(kc, ks, i) \
+    ((void *)((vaddr_t)(ks) + (kc)->kc_objoffset + (i) * (kc)->kc_size))
+
+static
+void
+slab_link(struct kmem_slab **head, struct kmem_slab *ks)
+{
+    ks->ks_next = *head;
+    ks->ks_prev = head;
+    if (ks->ks_next != NULL) {
+        ks->ks_next->ks_prev = &ks->ks_next;
+    }
+    *head = ks;
+}
+
+static
+void
+slab_unlink(struct kmem_slab *ks)
+{
+    KASSERT(*ks->ks_prev == ks);
+    *ks->ks_prev = ks->ks_next;
+    if (ks->ks_next != NULL) {
+        ks->ks_next->ks_prev = ks->ks_prev;
+    }
+}
+
+/*
+ * Make a new slab and construct all its objects. Called without the
+ * cache lock, since the constructor may well allocate memory itself.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+    struct kmem_slab *ks;
+    vaddr_t page;
+    unsigned i, j;
+
+    page = alloc_kpages(1);
+    if (page == 0) {
+        return NULL;
+    }
+    ks = (struct kmem_slab *)page;
+    ks->ks_cache = kc;
+    ks->ks_next = NULL;
+    ks->ks_prev = NULL;
+    ks->ks_nfree = kc->kc_perslab;
+    ks->ks_freehead = 0;
+    for (i = 0; i < kc->kc_perslab; i++) {
+        ks->ks_freelist[i] = (i + 1 < kc->kc_perslab) ? i + 1 : KMEM_NONE;
+        if (kc->kc_ctor != NULL && kc->kc_ctor(SLAB_OBJ(kc, ks, i))) {
+            /* Undo the ones we already built. */
+            for (j = 0; j < i; j++) {
+                if (kc->kc_dtor != NULL) {
+                    kc->kc_dtor(SLAB_OBJ(kc, ks, j));
+                }
+            }
+            free_kpages(page);
+            return NULL;
+        }
+    }
+    return ks;
+}
+
+/*
+ * Destroy all the objects in a free slab and give the page back.
+ * Called without the cache lock.
+ */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+    unsigned i;
+
+    KASSERT(ks->ks_nfree == kc->kc_perslab);
+    if (kc->kc_dtor != NULL) {
+        for (i = 0; i < kc->kc_perslab; i++) {
+            kc->kc_dtor(SLAB_OBJ(kc, ks, i));
+        }
+    }
+    free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Shrinker: destroy up to npages of the completely free slabs.
+ */
+static
+unsigned
+kmem_cache_shrink_count(void *data)
+{
+    struct kmem_cache *kc = data;
+
+    return kc->kc_nempty;
+}
+
+static
+unsigned
+kmem_cache_shrink_scan(void *data, unsigned npages)
+{
+    struct kmem_cache *kc = data;
+    struct kmem_slab *ks;
+    unsigned freed = 0;
+
+    while (freed < npages) {
+        spinlock_acquire(&kc->kc_lock);
+        for (ks = kc->kc_slabs; ks != NULL; ks = ks->ks_next) {
+            if (ks->ks_nfree == kc->kc_perslab) {
+                break;
+            }
+        }
+        if (ks == NULL) {
+            spinlock_release(&kc->kc_lock);
+            break;
+        }
+        slab_unlink(ks);
+        kc->kc_nslabs--;
+        kc->kc_nempty--;
+        spinlock_release(&kc->kc_lock);
+
+        slab_destroy(kc, ks);
+        freed++;
+    }
+    return freed;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+                  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+    struct kmem_cache *kc;
+    size_t hdr;
+    unsigned n;
+
+    size = ROUNDUP(size == 0 ? 1 : size, KMEM_ALIGN);
+
+    /* See how many objects fit along with the header. */
+    n = (PAGE_SIZE - sizeof(struct kmem_slab)) / (size + sizeof(uint16_t));
+    if (n > KMEM_NONE) {
+        n = KMEM_NONE;
+    }
+    while (n > 0) {
+        hdr = sizeof(struct kmem_slab) + n * sizeof(uint16_t);
+        hdr = ROUNDUP(hdr, KMEM_ALIGN);
+        if (hdr + n * size <= PAGE_SIZE) {
+            break;
+        }
+        n--;
+    }
+    if (n == 0) {
+        /* Too big for a page. */
+        return NULL;
+    }
+
+    kc = kmalloc(sizeof(*kc));
+    if (kc == NULL) {
+        return NULL;
+    }
+    kc->kc_name = kstrdup(name);
+    if (kc->kc_name == NULL) {
+        kfree(kc);
+        return NULL;
+    }
+    kc->kc_size = size;
+    kc->kc_perslab = n;
+    kc->kc_objoffset = hdr;
+    kc->kc_ctor = ctor;
+    kc->kc_dtor = dtor;
+    spinlock_init(&kc->kc_lock);
+    kc->kc_slabs = NULL;
+    kc->kc_full = NULL;
+    kc->kc_nempty = 0;
+    kc->kc_nslabs = 0;
+    kc->kc_inuse = 0;
+    kc->kc_allocs = 0;
+    kc->kc_frees = 0;
+    kc->kc_failed = 0;
+    kc->kc_shrinker.sh_name = kc->kc_name;
+    kc->kc_shrinker.sh_count = kmem_cache_shrink_count;
+    kc->kc_shrinker.sh_scan = kmem_cache_shrink_scan;
+    kc->kc_shrinker.sh_data = kc;
+    shrinker_register(&kc->kc_shrinker);
+
+    spinlock_acquire(&kmem_caches_lock);
+    kc->kc_next = kmem_caches;
+    kmem_caches = kc;
+    spinlock_release(&kmem_caches_lock);
+
+    return kc;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+    struct kmem_slab *ks;
+    unsigned i;
+
+    spinlock_acquire(&kc->kc_lock);
+    while (kc->kc_slabs == NULL) {
+        /*
+         * Make a new slab without the lock. Somebody else may add
+         * one meanwhile; then there's just one more free slab.
+         */
+        spinlock_release(&kc->kc_lock);
+        ks = slab_create(kc);
+        spinlock_acquire(&kc->kc_lock);
+        if (ks == NULL) {
+            kc->kc_failed++;
+            spinlock_release(&kc->kc_lock);
+            return NULL;
+        }
+        slab_link(&kc->kc_slabs, ks);
+        kc->kc_nslabs++;
+        kc->kc_nempty++;
+    }
+
+    ks = kc->kc_slabs;
+    KASSERT(ks->ks_nfree > 0);
+    if (ks->ks_nfree == kc->kc_perslab) {
+        KASSERT(kc->kc_nempty > 0);
+        kc->kc_nempty--;
+    }
+    i = ks->ks_freehead;
+    KASSERT(i < kc->kc_perslab);
+    ks->ks_freehead = ks->ks_freelist[i];
+    ks->ks_nfree--;
+    if (ks->ks_nfree == 0) {
+        slab_unlink(ks);
+        slab_link(&kc->kc_full, ks);
+    }
+    kc->kc_inuse++;
+    kc->kc_allocs++;
+    spinlock_release(&kc->kc_lock);
+
+    return SLAB_OBJ(kc, ks, i);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+    struct kmem_slab *ks, *victim = NULL;
+    vaddr_t offset;
+    unsigned i;
+
+    if (obj == NULL) {
+        return;
+    }
+    ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+    offset = (vaddr_t)obj - (vaddr_t)ks;
+    if (ks->ks_cache != kc || offset < kc->kc_objoffset ||
+        (offset - kc->kc_objoffset) % kc->kc_size != 0) {
+        panic("kmem_cache_free: %p is not from cache %s\n",
+              obj, kc->kc_name);
+    }
+    i = (offset - kc->kc_objoffset) / kc->kc_size;
+    KASSERT(i < kc->kc_perslab);
+
+    spinlock_acquire(&kc->kc_lock);
+    KASSERT(ks->ks_nfree < kc->kc_perslab);
+    if (ks->ks_nfree == 0) {
+        slab_unlink(ks);
+        slab_link(&kc->kc_slabs, ks);
+    }
+    ks->ks_freelist[i] = ks->ks_freehead;
+    ks->ks_freehead = i;
+    ks->ks_nfree++;
+    kc->kc_inuse--;
+    kc->kc_frees++;
+    if (ks->ks_nfree == kc->kc_perslab) {
+        if (kc->kc_nempty >= KMEM_MAXEMPTY) {
+            slab_unlink(ks);
+            kc->kc_nslabs--;
+            victim = ks;
+        }
+        else {
+            kc->kc_nempty++;
+        }
+    }
+    spinlock_release(&kc->kc_lock);
+
+    if (victim != NULL) {
+        slab_destroy(kc, victim);
+    }
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+    struct kmem_cache **kcp;
+    struct kmem_slab *ks;
+
+    KASSERT(kc->kc_inuse == 0);
+    KASSERT(kc->kc_full == NULL);
+
+    spinlock_acquire(&kmem_caches_lock);
+    for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+        KASSERT(*kcp != NULL);
+    }
+    *kcp = kc->kc_next;
+    spinlock_release(&kmem_caches_lock);
+    shrinker_unregister(&kc->kc_shrinker);
+
+    while ((ks = kc->kc_slabs) != NULL) {
+        slab_unlink(ks);
+        slab_destroy(kc, ks);
+    }
+    spinlock_cleanup(&kc->kc_lock);
+    kfree(kc->kc_name);
+    kfree(kc);
+}
+
+void
+kmem_cache_printstats(void)
+{
+    struct kmem_cache *kc;
+
+    kprintf("%-16s %6s %6s %6s %10s %10s %6s\n", "cache", "size",
+            "slabs", "inuse", "allocs", "frees", "failed");
+    spinlock_acquire(&kmem_caches_lock);
+    for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+        kprintf("%-16s %6u %6u %6u %10u %10u %6u\n", kc->kc_name,
+                (unsigned)kc->kc_size, kc->kc_nslabs, kc->kc_inuse,
+                kc->kc_allocs, kc->kc_frees, kc->kc_failed);
+    }
+    spinlock_release(&kmem_caches_lock);
+}
+
+/*
+ * Kernel menu command: print the statistics of all the caches.
+ */
+int
+kmemcache_menu(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+
+    kmem_cache_printstats();
+    return 0;
+}
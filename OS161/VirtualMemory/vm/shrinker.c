@@ -0,0 +1,168 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <shrinker.h>
+
+/*
+ * Memory-pressure callbacks. See shrinker.h.
+ *
+ * shrinker_lock only protects the list; the callbacks run without it.
+ * While one of its callbacks runs a shrinker is marked sh_busy, and
+ * shrink_caches skips busy shrinkers. So each cache is shrunk by only
+ * one cpu at a time, and a callback that gets back into alloc_kpages
+ * (and so into shrink_caches) doesn't call itself again.
+ *
+ * shrinker_unregister sleeps on shrinker_wchan until its shrinker is
+ * no longer busy before unlinking it. So the shrinker whose callback
+ * is running stays on the list, and the walk can go on from its
+ * sh_next once the callback returns.
+ */
+
+static struct spinlock shrinker_lock = SPINLOCK_INITIALIZER;
+static struct wchan *shrinker_wchan;
+static struct shrinker *shrinkers;
+static unsigned shrink_calls, shrink_failed;
+
+void
+shrinker_bootstrap(void)
+{
+    shrinker_wchan = wchan_create("shrinker");
+    if (shrinker_wchan == NULL) {
+        panic("shrinker_bootstrap: Out of memory\n");
+    }
+}
+
+/*
+ * Mark SH busy, so that it stays registered, and drop shrinker_lock
+ * to call it. Returns false if it's busy already.
+ */
+static
+bool
+shrinker_hold(struct shrinker *sh)
+{
+    KASSERT(spinlock_do_i_hold(&shrinker_lock));
+
+    if (sh->sh_busy) {
+        return false;
+    }
+    sh->sh_busy = true;
+    spinlock_release(&shrinker_lock);
+    return true;
+}
+
+/*
+ * Undo shrinker_hold, taking shrinker_lock back.
+ */
+static
+void
+shrinker_drop(struct shrinker *sh)
+{
+    spinlock_acquire(&shrinker_lock);
+    KASSERT(sh->sh_busy);
+    sh->sh_busy = false;
+    wchan_wakeall(shrinker_wchan, &shrinker_lock);
+}
+
+void
+shrinker_register(struct shrinker *sh)
+{
+    KASSERT(sh->sh_count != NULL && sh->sh_scan != NULL);
+
+    sh->sh_busy = false;
+    sh->sh_calls = 0;
+    sh->sh_freed = 0;
+    spinlock_acquire(&shrinker_lock);
+    sh->sh_next = shrinkers;
+    shrinkers = sh;
+    spinlock_release(&shrinker_lock);
+}
+
+void
+shrinker_unregister(struct shrinker *sh)
+{
+    struct shrinker **shp;
+
+    spinlock_acquire(&shrinker_lock);
+    while (sh->sh_busy) {
+        wchan_sleep(shrinker_wchan, &shrinker_lock);
+    }
+    for (shp = &shrinkers; *shp != sh; shp = &(*shp)->sh_next) {
+        KASSERT(*shp != NULL);
+    }
+    *shp = sh->sh_next;
+    spinlock_release(&shrinker_lock);
+}
+
+unsigned
+shrink_caches(unsigned npages)
+{
+    struct shrinker *sh;
+    unsigned count, freed = 0, n;
+
+    spinlock_acquire(&shrinker_lock);
+    shrink_calls++;
+    for (sh = shrinkers; sh != NULL && freed < npages; sh = sh->sh_next) {
+        if (!shrinker_hold(sh)) {
+            continue;
+        }
+        n = 0;
+        count = sh->sh_count(sh->sh_data);
+        if (count > 0) {
+            n = npages - freed;
+            n = sh->sh_scan(sh->sh_data, count < n ? count : n);
+        }
+        shrinker_drop(sh);
+        if (count > 0) {
+            sh->sh_calls++;
+            sh->sh_freed += n;
+            freed += n;
+        }
+    }
+    if (freed == 0) {
+        shrink_failed++;
+    }
+    spinlock_release(&shrinker_lock);
+    return freed;
+}
+
+/*
+ * Kernel menu command:
+ *    shrink N  - ask the caches to free N pages
+ *    shrink    - print the shrinkers and their statistics
+ */
+int
+shrinker_menu(int nargs, char **args)
+{
+    struct shrinker *sh;
+    unsigned freed, count;
+
+    if (nargs == 2) {
+        freed = shrink_caches(atoi(args[1]));
+        kprintf("shrink: %u pages freed\n", freed);
+        return 0;
+    }
+    if (nargs != 1) {
+        kprintf("Usage: shrink [npages]\n");
+        return EINVAL;
+    }
+
+    spinlock_acquire(&shrinker_lock);
+    kprintf("%-16s %8s %8s %8s\n", "shrinker", "count", "calls", "freed");
+    for (sh = shrinkers; sh != NULL; sh = sh->sh_next) {
+        if (!shrinker_hold(sh)) {
+            kprintf("%-16s %8s %8u %8u\n", sh->sh_name, "busy",
+                    sh->sh_calls, sh->sh_freed);
+            continue;
+        }
+        count = sh->sh_count(sh->sh_data);
+        shrinker_drop(sh);
+        kprintf("%-16s %8u %8u %8u\n", sh->sh_name,
+                count, sh->sh_calls, sh->sh_freed);
+    }
+    kprintf("shrink: %u calls, %u freed nothing\n",
+            shrink_calls, shrink_failed);
+    spinlock_release(&shrinker_lock);
+    return 0;
+}
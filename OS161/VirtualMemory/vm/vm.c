@@ -10,20 +10,28 @@
 #include <elf.h>
 #include <spl.h>
 #include <proc.h>
+#include <synch.h>
+#include <clock.h>
+#include <vmtrace.h>
+#include <vmstat.h>
+#include <kfence.h>
+#include <shrinker.h>
 
 /*
  * Initialise the frame table
  */
 
-struct page_table_entry *page_table;
-struct spinlock page_table_lock = SPINLOCK_INITIALIZER;
 int framenum;
+int vm_oom_policy = VM_OOM_KILL;
 
 void
 vm_bootstrap(void) 
 {
     paddr_t firsta=0, lasta=0, paddr;
-    int entry_num, frame_table_size, i, page_table_size;
+    int entry_num, frame_table_size, i;
+    shrinker_bootstrap();
+    // let kmalloc size its tables while it can still steal memory
+    kheap_bootstrap();
     // get the useable range of physical memory
     lasta = ram_getsize();
     firsta = ram_getfirstfree();
@@ -34,14 +42,9 @@ vm_bootstrap(void)
     frame_table_size = framenum * sizeof(struct frame_table_entry);
     frame_table_size = ROUNDUP(frame_table_size, PAGE_SIZE);
     entry_num = frame_table_size / PAGE_SIZE;
-    //set the size of page table
-    page_table_size = 2*framenum * sizeof(struct page_table_entry);
-    page_table_size = ROUNDUP(page_table_size, PAGE_SIZE);
-    entry_num += page_table_size / PAGE_SIZE;
     
     frametop = firsta;
-    pagetop = firsta + frame_table_size;
-    freeframe = firsta + frame_table_size + page_table_size;
+    freeframe = firsta + frame_table_size;
     
     if (freeframe >= lasta) {
             // This is impossible for most of the time
@@ -51,11 +54,11 @@ vm_bootstrap(void)
     // keep the frame state in the top of the useable range of physical memory
     // the free frame page address started from the end of the frame map
     frame_table = (struct frame_table_entry *) PADDR_TO_KVADDR(firsta);
-    page_table = (struct page_table_entry *) PADDR_TO_KVADDR(pagetop);
     
     // Initialise the frame list, each entry corrsponding to a frame,
     // and each entry stores the address of the next free frame.
     // If the next frame address of this entry equals zero, means this current frame is allocated
+    // or it is the last free frame
     for (i = 0; i < framenum-1; i++) {
         if (i < entry_num) {
             frame_table[i].next_freeframe = 0;
@@ -64,46 +67,89 @@ vm_bootstrap(void)
         paddr = frametop + (i+1) * PAGE_SIZE;
         frame_table[i].next_freeframe = paddr;
     }
-    frame_table[framenum-1].next_freeframe = frametop + (entry_num) * PAGE_SIZE;
-    for (i = 0; i < framenum*2; i++) {
-        page_table[i].id=0;
+    frame_table[framenum-1].next_freeframe = 0;
+    frames_total = framenum;
+    frames_inuse = entry_num;
+
+    // kmalloc works from here on
+    as_bootstrap();
+}
+
+static void vm_tlb_load(vaddr_t vaddr, paddr_t elo_frame);
+static vaddr_t vm_getframe(struct addrspace *as);
+static int vm_fault_handle(int faulttype, vaddr_t faultaddress, int *outcome);
+
+/*
+ * Fault entry point called by trap code. With tracing off this only costs
+ * the test of vmtrace_enabled, otherwise the fault is timed and recorded.
+ */
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct timespec before, after;
+    int result, outcome = VMTRACE_HIT;
+
+    vmstat_inc(faulttype == VM_FAULT_READONLY ? VMSTAT_READONLY : VMSTAT_TLBMISS);
+    if (!vmtrace_enabled) {
+        return vm_fault_handle(faulttype, faultaddress, &outcome);
     }
+    gettime(&before);
+    result = vm_fault_handle(faulttype, faultaddress, &outcome);
+    gettime(&after);
+    vmtrace_record(faulttype, faultaddress, proc_getas(),
+                   result ? VMTRACE_ERROR : outcome, result, &before, &after);
+    return result;
 }
 
 /*
  * When TLB miss happening, a page fault will be trigged.
  * The way to handle it is as follow:
- * 1. check what page fault it is, if it is READONLY fault, 
- *    then do nothing just pop up an exception and kill the process
+ * 1. check what page fault it is, if it is not a read, write or READONLY
+ *    fault, then do nothing just pop up an exception
  * 2. if it is a read fault or write fault
  *    1. first check whether this virtual address is within any of the regions
  *       or stack of the current addrspace. if it is not, pop up a exception and
  *       kill the process, if it is there, goes on. 
  *    2. then try to find the mapping in the page table, 
  *       if a page table entry exists for this virtual address insert it into TLB 
- *    3. if this virtual address is not mapped yet, mapping this address,
- *   update the pagetable, then insert it into TLB
+ *    3. if this virtual address is not mapped yet, allocate and zero a frame
+ *       without holding the addrspace lock, then take the lock again and 
+ *       update the pagetable, then insert it into TLB
+ *    4. writable pages are loaded without TLBLO_DIRTY until they are written,
+ *       a write fault or the READONLY trap of the first write sets PTE_DIRTY
+ * 3. if it is a READONLY fault, it is the first write to a clean page when
+ *    the region is writable, otherwise pop up an exception and kill the process
+ * Only the lock of the faulting addrspace is held, and never while a frame
+ * is zeroed, so faults of different processes run at the same time and
+ * only share frametable_lock while a frame is taken off the free list.
  */
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+vm_fault_handle(int faulttype, vaddr_t faultaddress, int *outcome)
 {
     vaddr_t vaddr, vbase, vtop, faultadd = 0;
-    paddr_t paddr;
+    paddr_t paddr, newpaddr;
     struct addrspace *as;
     struct as_region *re;
-    uint32_t ehi, elo;
-    int i, spl;
+    int result;
     int permis = 0;
+    bool dirty = false;
     
     switch (faulttype) {
         case VM_FAULT_READONLY:
-            return EFAULT;
         case VM_FAULT_READ:
         case VM_FAULT_WRITE:
             break;
         default:
             return EINVAL;
     }
+
+    // sampled kmalloc blocks, mapped in kseg2 with guard pages around
+    if (KFENCE_ISADDR(faultaddress)) {
+        paddr = kfence_fault(faulttype, faultaddress);
+        vm_tlb_load(faultaddress & PAGE_FRAME, paddr | TLBLO_DIRTY);
+        return 0;
+    }
     
     as = proc_getas();
     if (as == NULL) {
@@ -113,6 +159,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     // Align faultaddress
     faultaddress &= PAGE_FRAME;
     
+    lock_acquire(as->as_lock);
+    // the OOM killer picked this process and took its pages, let it die
+    if (as->as_oomkilled) {
+        lock_release(as->as_lock);
+        return ENOMEM;
+    }
+
     // Go through the link list of regions 
     // Check the validation of the faultaddress
     KASSERT(as->as_regions_start != 0);
@@ -143,30 +196,97 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         
         // faultaddress is not within any range of the regions and stack
         if (faultadd == 0) {
+            lock_release(as->as_lock);
+            return EFAULT;
+        }
+    }
+    // a write to a clean page, only legal in a writable region
+    if (faulttype == VM_FAULT_READONLY) {
+        paddr = look_up_page_table(as, faultaddress);
+        if (paddr == 0 || (permis & PF_W) == 0) {
+            lock_release(as->as_lock);
             return EFAULT;
         }
+        page_table_set_dirty(as, faultaddress);
+        *outcome = VMTRACE_DIRTY;
+        vm_tlb_load(faultaddress, paddr | TLBLO_DIRTY);
+        lock_release(as->as_lock);
+        return 0;
     }
-    paddr = look_up_page_table((uint32_t)as, faultaddress);
+    paddr = look_up_page_table(as, faultaddress);
+    vmstat_inc(paddr != 0 ? VMSTAT_PTHIT : VMSTAT_PTMISS);
     //not exist
     if(paddr == 0){
-        vaddr = alloc_kpages(1);
-        KASSERT(vaddr != 0);
+        lock_release(as->as_lock);
+        // get the frame ready before taking the lock again,
+        // the frame allocator has its own lock
+        vaddr = vm_getframe(as);
         if (vaddr == 0){
             return ENOMEM;
         }
         as_zero_region(vaddr, 1);
-        paddr = KVADDR_TO_PADDR(vaddr);
-        page_table_insert((uint32_t)as, faultaddress, paddr);
-        if (permis & PF_W) {
-            paddr |= TLBLO_DIRTY;
+        newpaddr = KVADDR_TO_PADDR(vaddr);
+
+        lock_acquire(as->as_lock);
+        // killed in the mean time, nothing may be mapped any more
+        if (as->as_oomkilled) {
+            lock_release(as->as_lock);
+            free_kpages(vaddr);
+            return ENOMEM;
         }
-    }
-    else{
-        if (permis & PF_W) {
-            paddr |= TLBLO_DIRTY;
+        // another thread of this addrspace may mapped it in the mean time
+        paddr = look_up_page_table(as, faultaddress);
+        if (paddr == 0) {
+            result = page_table_insert(as, faultaddress, newpaddr);
+            if (result) {
+                lock_release(as->as_lock);
+                free_kpages(vaddr);
+                return result;
+            }
+            paddr = newpaddr;
+            vaddr = 0;
+            *outcome = VMTRACE_ALLOC;
         }
-    }    
+        if (vaddr != 0) {
+            free_kpages(vaddr);
+        }
+    }
+    if (faulttype == VM_FAULT_WRITE && (permis & PF_W)) {
+        page_table_set_dirty(as, faultaddress);
+    }
+    dirty = page_table_is_dirty(as, faultaddress);
+    // writable pages stay write protected until the first write,
+    // which traps as VM_FAULT_READONLY and marks the page dirty
+    if (dirty && (permis & PF_W)) {
+        paddr |= TLBLO_DIRTY;
+    }
+    // still under as_lock, so the OOM killer cannot free the frame
+    // before the entry is in the TLB, see as_oom_reap
+    vm_tlb_load(faultaddress, paddr);
+    lock_release(as->as_lock);
+    return 0;
+}
+
+/*
+ * Load the mapping of vaddr into the TLB. elo holds the frame and TLBLO_DIRTY
+ * if the page may be written. If vaddr is already in the TLB (a write to a
+ * clean page) the entry is replaced, otherwise it goes to an empty slot or a
+ * random one.
+ */
+static
+void
+vm_tlb_load(vaddr_t vaddr, paddr_t elo_frame)
+{
+    uint32_t ehi, elo;
+    int i, spl;
+
     spl = splhigh();
+    i = tlb_probe(vaddr, 0);
+    if (i >= 0) {
+        tlb_write(vaddr, elo_frame | TLBLO_VALID, i);
+        splx(spl);
+        return;
+    }
     // update TLB entry
     // if there still a empty TLB entry, insert new one in
     // if not, randomly select one, throw it, insert new one in
@@ -175,136 +295,361 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         if (elo & TLBLO_VALID) {
             continue;
         }
-        ehi = faultaddress;
-        elo = paddr | TLBLO_VALID;
+        ehi = vaddr;
+        elo = elo_frame | TLBLO_VALID;
         tlb_write(ehi, elo, i);
         splx(spl);
-        return 0;
+        return;
     }
-    ehi = faultaddress;
-    elo = paddr | TLBLO_VALID;
+    ehi = vaddr;
+    elo = elo_frame | TLBLO_VALID;
     tlb_random(ehi, elo);
     splx(spl);
+}
+
+/*
+ * Give back the pages of as that are clean and still all zeros: they were
+ * never written since they were zero filled, so a later fault just maps a
+ * new zero filled frame. Only the current addrspace is reclaimed from,
+ * since its TLB entries can only be in the TLB of this cpu.
+ * Looking into a page costs up to a page of reads on the fault path, so
+ * each call looks into at most VM_RECLAIM_SCAN clean pages, going on from
+ * where the last call stopped.
+ * Returns the number of frames freed.
+ */
+static
+unsigned
+vm_reclaim_clean(struct addrspace *as)
+{
+    unsigned n, page, i, j, k, scanned = 0, freed = 0;
+    int spl, slot;
+    paddr_t *pt;
+    uint32_t *frame;
+    vaddr_t va;
+    lock_acquire(as->as_lock);
+    if (as->as_pagetable == NULL) {
+        lock_release(as->as_lock);
+        return 0;
+    }
+    for (n = 0; n < PTE_NUM * PTE_NUM && scanned < VM_RECLAIM_SCAN; n++) {
+        page = (as->as_reclaimnext + n) % (PTE_NUM * PTE_NUM);
+        i = page / PTE_NUM;
+        j = page % PTE_NUM;
+        if (as->as_pagetable[i] == 0) {
+            // skip the rest of this second level table
+            n += PTE_NUM - 1 - j;
+            continue;
+        }
+        pt = (paddr_t *)PADDR_TO_KVADDR(as->as_pagetable[i]);
+        if ((pt[j] & (PTE_VALID | PTE_DIRTY)) != PTE_VALID) {
+            continue;
+        }
+        scanned++;
+        frame = (uint32_t *)PADDR_TO_KVADDR(pt[j] & PAGE_FRAME);
+        for (k = 0; k < PAGE_SIZE / 4 && frame[k] == 0; k++);
+        if (k < PAGE_SIZE / 4) {
+            continue;
+        }
+        va = ((vaddr_t)i << 22) | ((vaddr_t)j << 12);
+        spl = splhigh();
+        slot = tlb_probe(va, 0);
+        if (slot >= 0) {
+            tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+        }
+        splx(spl);
+        free_kpages((vaddr_t)frame);
+        pt[j] = 0;
+        as->as_resident--;
+        freed++;
+    }
+    as->as_reclaimnext = (as->as_reclaimnext + n) % (PTE_NUM * PTE_NUM);
+    lock_release(as->as_lock);
+    return freed;
+}
+
+/*
+ * Get a frame for a user page of as, which must not be locked by the
+ * caller. alloc_kpages has already asked the shrinkers; when there is
+ * still none left, first take back what else costs nothing (blocks in
+ * this cpu's kmalloc magazines, clean zero pages of as), then apply
+ * vm_oom_policy:
+ *    VM_OOM_FAIL  - fail, the fault kills the faulting process
+ *    VM_OOM_KILL  - kill the process with the most resident pages, which
+ *                   frees its pages before returning, and retry; or fail
+ *                   if that is us
+ *    VM_OOM_PANIC - panic
+ * Returns 0 if no frame could be found, or as was killed meanwhile.
+ */
+static
+vaddr_t
+vm_getframe(struct addrspace *as)
+{
+    vaddr_t vaddr;
+    int tries;
+
+    KASSERT(!lock_do_i_hold(as->as_lock));
+    for (tries = 0; tries < VM_OOM_RETRIES; tries++) {
+        if (as->as_oomkilled) {
+            return 0;
+        }
+        vaddr = alloc_kpages(1);
+        if (vaddr != 0) {
+            return vaddr;
+        }
+        if (kheap_reclaim() > 0 || vm_reclaim_clean(as) > 0) {
+            continue;
+        }
+        switch (vm_oom_policy) {
+            case VM_OOM_PANIC:
+                panic("vm: out of memory\n");
+            case VM_OOM_KILL:
+                if (!as_oom_kill_largest(as)) {
+                    return 0;
+                }
+                break;
+            default:
+                return 0;
+        }
+    }
     return 0;
 }
 
 /*
- * SMP-specific functions.  Unused in our configuration.
+ * SMP-specific functions. Only the OOM killer sends shootdowns, see
+ * as_oom_reap.
  */
 void
 vm_tlbshootdown_all(void)
 {
-    panic("vm tried to do tlb shootdown?!\n");
+    as_tlbshootdown();
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+    // only the OOM killer sends them, and it wants the whole TLB flushed
     (void)ts;
-    panic("vm tried to do tlb shootdown?!\n");
+    as_tlbshootdown();
 }
 
-paddr_t look_up_page_table(uint32_t check_id, vaddr_t va) {
-    struct page_table_entry * pte=page_table;
-    paddr_t temp_p, pa;
-    int i;
+/*
+ * The second level table that maps va, NULL if there is none yet.
+ * Both levels are single frames: the first level holds the physical
+ * addresses of the second level tables, which hold the PTEs.
+ */
+static
+paddr_t *
+page_table_level2(struct addrspace *as, vaddr_t va)
+{
+    paddr_t pde;
+
+    if (as->as_pagetable == NULL) {
+        return NULL;
+    }
+    pde = as->as_pagetable[PT_TOP_INDEX(va)];
+    if (pde == 0) {
+        return NULL;
+    }
+    return (paddr_t *)PADDR_TO_KVADDR(pde);
+}
+
+/*
+ * Find the frame mapped at va, return 0 if va is not mapped yet.
+ */
+paddr_t look_up_page_table(struct addrspace *as, vaddr_t va) {
+    paddr_t *pt;
+    paddr_t pte;
     KASSERT((va & PAGE_FRAME) == va);   
-    // if page table has no entries, return NULL
-    pa = KVADDR_TO_PADDR(va);
-    i = (pa - frametop) / PAGE_SIZE;
-    pte+=i;
-    if (((pte->id) == check_id) && ((pte->page_addr) == va)) {
-        temp_p = pte->frame_addr;
-        return temp_p;
-    }
-    pte += framenum;
-    if (((pte->id) == check_id) && ((pte->page_addr) == va)) {
-        temp_p = pte->frame_addr;
-        return temp_p;
-    }
-    pte=page_table;
-    for (i = 0; i < framenum; i++) {
-        if (((pte->id) == check_id) && ((pte->page_addr) == va)) {
-            temp_p = pte->frame_addr;
-            return temp_p;
-        }
-        pte += 1;
+    KASSERT(lock_do_i_hold(as->as_lock));
+    pt = page_table_level2(as, va);
+    if (pt == NULL) {
+        return 0;
+    }
+    pte = pt[PT_MID_INDEX(va)];
+    if ((pte & PTE_VALID) == 0) {
+        return 0;
     }
-    // last case, full page table scanned and entry not found
-    return 0;     
+    return pte & PAGE_FRAME;
 }
 
-struct page_table_entry * page_table_insert(uint32_t id, vaddr_t va, paddr_t pa) {
-    int i;
-    paddr_t paddr;
-    struct page_table_entry * pte=page_table; 
+/*
+ * Map va to the frame pa, allocating the page table levels if needed.
+ */
+int page_table_insert(struct addrspace *as, vaddr_t va, paddr_t pa) {
+    vaddr_t page;
+    paddr_t *pt;
     KASSERT(va < 0x80000000);
-    KASSERT(pte != NULL); 
-    paddr = KVADDR_TO_PADDR(va);
-    i = (paddr - frametop) / PAGE_SIZE;
-    pte += i;
-    if (pte->id==0){
-        pte->page_addr = va;
-        pte->frame_addr = pa;
-        pte->id = id;
-        return pte;
-    }
-    pte += framenum;
-    if(pte->id==0){
-        pte->page_addr = va;
-        pte->frame_addr = pa;
-        pte->id = id;
-        return pte;
-    }
-    pte=page_table;
-    for (i = 0; i < framenum; i++) {
-        if (pte->id==0) {
-            break;
+    KASSERT((pa & PAGE_FRAME) == pa);
+    KASSERT(lock_do_i_hold(as->as_lock));
+    if (as->as_pagetable == NULL) {
+        page = alloc_kpages(1);
+        if (page == 0) {
+            return ENOMEM;
         }
-        pte += 1;
+        bzero((void *)page, PAGE_SIZE);
+        as->as_pagetable = (paddr_t *)page;
     }
-    if(pte->id==0){
-        pte->page_addr = va;
-        pte->frame_addr = pa;
-        pte->id = id;
-        return pte;
+    pt = page_table_level2(as, va);
+    if (pt == NULL) {
+        page = alloc_kpages(1);
+        if (page == 0) {
+            return ENOMEM;
+        }
+        bzero((void *)page, PAGE_SIZE);
+        as->as_pagetable[PT_TOP_INDEX(va)] = KVADDR_TO_PADDR(page);
+        pt = (paddr_t *)page;
     }
-    return 0;        
+    KASSERT((pt[PT_MID_INDEX(va)] & PTE_VALID) == 0);
+    pt[PT_MID_INDEX(va)] = pa | PTE_VALID;
+    as->as_resident++;
+    return 0;
 }
 
-/* method to delete a particular page table entry */
+/*
+ * Dirty bit of the page mapped at va, which must be mapped already.
+ */
+void page_table_set_dirty(struct addrspace *as, vaddr_t va) {
+    paddr_t *pt;
+    KASSERT(lock_do_i_hold(as->as_lock));
+    pt = page_table_level2(as, va);
+    KASSERT(pt != NULL && (pt[PT_MID_INDEX(va)] & PTE_VALID));
+    pt[PT_MID_INDEX(va)] |= PTE_DIRTY;
+}
+
+bool page_table_is_dirty(struct addrspace *as, vaddr_t va) {
+    paddr_t *pt;
+    KASSERT(lock_do_i_hold(as->as_lock));
+    pt = page_table_level2(as, va);
+    if (pt == NULL) {
+        return false;
+    }
+    return (pt[PT_MID_INDEX(va)] & (PTE_VALID | PTE_DIRTY)) == (PTE_VALID | PTE_DIRTY);
+}
+
+/*
+ * Mark the page at va clean again once its contents have been written back
+ * (eviction, msync, checkpoint). The TLB entry is dropped so that the next
+ * write traps and dirties the page again. Only the TLB of the current cpu is
+ * flushed, fine as long as processes are single threaded.
+ */
+void page_table_clean(struct addrspace *as, vaddr_t va) {
+    paddr_t *pt;
+    int i, spl;
+    KASSERT(lock_do_i_hold(as->as_lock));
+    pt = page_table_level2(as, va);
+    if (pt == NULL) {
+        return;
+    }
+    pt[PT_MID_INDEX(va)] &= ~PTE_DIRTY;
+    if (as != proc_getas()) {
+        return;
+    }
+    spl = splhigh();
+    i = tlb_probe(va, 0);
+    if (i >= 0) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    splx(spl);
+}
+
+/* method to free the whole page table and the frames mapped in it */
 void 
-delete_page_table_entry(uint32_t id) {
-    int i;
-    struct page_table_entry * pte; 
-    pte = page_table;
-    KASSERT(pte != NULL); 
-    for (i = 0; i < framenum*2; i++) {
-        if (pte->id==id) {
-            pte->id=0;
+delete_page_table(struct addrspace *as) {
+    int i, j;
+    paddr_t *pt;
+    lock_acquire(as->as_lock);
+    if (as->as_pagetable == NULL) {
+        lock_release(as->as_lock);
+        return;
+    }
+    for (i = 0; i < PTE_NUM; i++) {
+        if (as->as_pagetable[i] == 0) {
+            continue;
+        }
+        pt = (paddr_t *)PADDR_TO_KVADDR(as->as_pagetable[i]);
+        for (j = 0; j < PTE_NUM; j++) {
+            if (pt[j] & PTE_VALID) {
+                free_kpages(PADDR_TO_KVADDR(pt[j] & PAGE_FRAME));
+            }
         }
-        pte += 1;
-    } 
+        free_kpages((vaddr_t)pt);
+    }
+    free_kpages((vaddr_t)as->as_pagetable);
+    as->as_pagetable = NULL;
+    as->as_resident = 0;
+    lock_release(as->as_lock);
 }
+
+/*
+ * Give newas a private copy of every page mapped in oldas.
+ * newas is not visible to anybody else yet, only oldas gets locked.
+ * When there is no free frame, both locks are dropped and the frame is
+ * got from vm_getframe, which reclaims or kills like a fault would; the
+ * page is then looked up again, as it may have gone in the mean time.
+ */
 int 
-copyPageTable(uint32_t oldas, uint32_t newas) {
-    struct page_table_entry * pte=page_table;
-    int i;
+copyPageTable(struct addrspace *oldas, struct addrspace *newas) {
+    int i, j, result;
+    paddr_t *pt;
     paddr_t paddr;
     vaddr_t vaddr, vaddr_new;
-    for (i = 0; i < framenum*2; i++) {
-        if (pte->id == oldas) {
-            vaddr = pte->page_addr;
+    lock_acquire(oldas->as_lock);
+    lock_acquire(newas->as_lock);
+    if (oldas->as_pagetable == NULL) {
+        lock_release(newas->as_lock);
+        lock_release(oldas->as_lock);
+        return 0;
+    }
+    for (i = 0; i < PTE_NUM; i++) {
+        if (oldas->as_pagetable[i] == 0) {
+            continue;
+        }
+        pt = (paddr_t *)PADDR_TO_KVADDR(oldas->as_pagetable[i]);
+        for (j = 0; j < PTE_NUM; j++) {
+            if ((pt[j] & PTE_VALID) == 0) {
+                continue;
+            }
+            vaddr = ((vaddr_t)i << 22) | ((vaddr_t)j << 12);
             vaddr_new = alloc_kpages(1);
             if (vaddr_new == 0){
-                return ENOMEM;
+                lock_release(newas->as_lock);
+                lock_release(oldas->as_lock);
+                vaddr_new = vm_getframe(oldas);
+                if (vaddr_new == 0) {
+                    return ENOMEM;
+                }
+                lock_acquire(oldas->as_lock);
+                lock_acquire(newas->as_lock);
+                // only the OOM killer frees page tables of a live addrspace
+                if (oldas->as_oomkilled || newas->as_oomkilled) {
+                    lock_release(newas->as_lock);
+                    lock_release(oldas->as_lock);
+                    free_kpages(vaddr_new);
+                    return ENOMEM;
+                }
+                // a clean zero page, reclaimed while the locks were dropped
+                if ((pt[j] & PTE_VALID) == 0) {
+                    free_kpages(vaddr_new);
+                    continue;
+                }
             }
-            as_zero_region(vaddr_new, 1);
+            memcpy((void *)vaddr_new, (const void *) PADDR_TO_KVADDR(pt[j] & PAGE_FRAME), PAGE_SIZE);
+            vmstat_inc(VMSTAT_COPIED);
             paddr = KVADDR_TO_PADDR(vaddr_new);
-            page_table_insert(newas, vaddr, paddr);
-            memcpy((void *)vaddr_new, (const void *) PADDR_TO_KVADDR(pte->frame_addr), PAGE_SIZE);
+            result = page_table_insert(newas, vaddr, paddr);
+            if (result) {
+                free_kpages(vaddr_new);
+                lock_release(newas->as_lock);
+                lock_release(oldas->as_lock);
+                return result;
+            }
+            // the copy holds the same data, so it is as dirty as the original
+            if (pt[j] & PTE_DIRTY) {
+                page_table_set_dirty(newas, vaddr);
+            }
         }
-        pte += 1;
-    } 
+    }
+    lock_release(newas->as_lock);
+    lock_release(oldas->as_lock);
     return 0;
 }
@@ -0,0 +1,97 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <vmstat.h>
+
+/*
+ * Per-cpu VM counters. See vmstat.h.
+ */
+
+static unsigned vmstat_counters[VM_MAXCPUS][VMSTAT_NCOUNTERS];
+
+void
+vmstat_add(unsigned which, unsigned n)
+{
+    unsigned cpunum;
+    int spl;
+
+    KASSERT(which < VMSTAT_NCOUNTERS);
+    spl = splhigh();
+    cpunum = curcpu->c_number;
+    if (cpunum < VM_MAXCPUS) {
+        vmstat_counters[cpunum][which] += n;
+    }
+    splx(spl);
+}
+
+void
+vmstat_get(struct vmstat *vs)
+{
+    unsigned total[VMSTAT_NCOUNTERS];
+    unsigned i, j;
+
+    for (j = 0; j < VMSTAT_NCOUNTERS; j++) {
+        total[j] = 0;
+    }
+    for (i = 0; i < VM_MAXCPUS; i++) {
+        for (j = 0; j < VMSTAT_NCOUNTERS; j++) {
+            total[j] += vmstat_counters[i][j];
+        }
+    }
+    vs->vs_tlbmisses = total[VMSTAT_TLBMISS];
+    vs->vs_readonly = total[VMSTAT_READONLY];
+    vs->vs_pthits = total[VMSTAT_PTHIT];
+    vs->vs_ptmisses = total[VMSTAT_PTMISS];
+    vs->vs_zeroed = total[VMSTAT_ZEROED];
+    vs->vs_copied = total[VMSTAT_COPIED];
+
+    spinlock_acquire(&frametable_lock);
+    vs->vs_framesused = frames_inuse;
+    vs->vs_framesfree = frames_total - frames_inuse;
+    spinlock_release(&frametable_lock);
+
+    vs->vs_kheappages = kheap_pagesinuse();
+}
+
+/*
+ * vmstat system call: copy the statistics to the user buffer.
+ */
+int
+sys_vmstat(userptr_t buf)
+{
+    struct vmstat vs;
+
+    vmstat_get(&vs);
+    return copyout(&vs, buf, sizeof(vs));
+}
+
+/*
+ * Kernel menu command: print the statistics.
+ */
+int
+vmstat_menu(int nargs, char **args)
+{
+    struct vmstat vs;
+
+    (void)nargs;
+    (void)args;
+
+    vmstat_get(&vs);
+    kprintf("tlb misses        %10u\n", vs.vs_tlbmisses);
+    kprintf("readonly faults   %10u\n", vs.vs_readonly);
+    kprintf("page table hits   %10u\n", vs.vs_pthits);
+    kprintf("page table misses %10u\n", vs.vs_ptmisses);
+    kprintf("pages zeroed      %10u\n", vs.vs_zeroed);
+    kprintf("pages copied      %10u\n", vs.vs_copied);
+    kprintf("frames free       %10u\n", vs.vs_framesfree);
+    kprintf("frames used       %10u\n", vs.vs_framesused);
+    kprintf("kmalloc pages     %10u\n", vs.vs_kheappages);
+    return 0;
+}
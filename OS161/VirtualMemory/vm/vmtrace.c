@@ -0,0 +1,225 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <clock.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <vmtrace.h>
+
+/*
+ * Per-cpu rings of vm_fault() events. See vmtrace.h.
+ */
+
+struct vmtrace_ring {
+    unsigned vr_head;    /* total number of events recorded */
+    struct vmtrace_event vr_events[VMTRACE_NEVENTS];
+};
+
+volatile bool vmtrace_enabled = false;
+static struct vmtrace_ring *vmtrace_rings[VM_MAXCPUS];
+
+/*
+ * Record one fault in the ring of the current cpu.
+ * Interrupts are off while the slot is filled, so a thread switch
+ * on this cpu cannot interleave with us and no lock is needed.
+ */
+void
+vmtrace_record(int faulttype, vaddr_t faultaddress, struct addrspace *as,
+               int outcome, int error,
+               const struct timespec *start, const struct timespec *end)
+{
+    struct timespec diff;
+    struct vmtrace_ring *ring;
+    struct vmtrace_event *ev;
+    unsigned cpunum;
+    int spl;
+
+    timespec_sub(end, start, &diff);
+
+    spl = splhigh();
+    cpunum = curcpu->c_number;
+    if (cpunum >= VM_MAXCPUS || vmtrace_rings[cpunum] == NULL) {
+        splx(spl);
+        return;
+    }
+    ring = vmtrace_rings[cpunum];
+    ev = &ring->vr_events[ring->vr_head % VMTRACE_NEVENTS];
+    ev->vte_seq = ring->vr_head;
+    ev->vte_addr = faultaddress;
+    ev->vte_asid = (uint32_t)as;
+    ev->vte_nsecs = diff.tv_sec * 1000000000 + diff.tv_nsec;
+    ev->vte_cpu = cpunum;
+    ev->vte_type = faulttype;
+    ev->vte_result = outcome;
+    ev->vte_error = error;
+    ring->vr_head++;
+    splx(spl);
+}
+
+/*
+ * Turn tracing on or off. Turning it on allocates the rings the
+ * first time and clears them; they are only published to vm_fault
+ * once they are fully set up.
+ */
+int
+vmtrace_set(bool on)
+{
+    struct vmtrace_ring *ring;
+    unsigned i;
+
+    vmtrace_enabled = false;
+    membar_store_store();
+    if (!on) {
+        return 0;
+    }
+    for (i = 0; i < VM_MAXCPUS; i++) {
+        if (vmtrace_rings[i] == NULL) {
+            ring = kmalloc(sizeof(struct vmtrace_ring));
+            if (ring == NULL) {
+                return ENOMEM;
+            }
+            vmtrace_rings[i] = ring;
+        }
+        vmtrace_rings[i]->vr_head = 0;
+    }
+    membar_store_store();
+    vmtrace_enabled = true;
+    return 0;
+}
+
+/*
+ * Copy the events still in the rings to buf, cpu by cpu, oldest first,
+ * leaving out the first skip of them.
+ * Events recorded while we copy may be torn; that is fine for a trace.
+ */
+unsigned
+vmtrace_read(struct vmtrace_event *buf, unsigned max, unsigned skip)
+{
+    struct vmtrace_ring *ring;
+    unsigned i, seq, head, n = 0;
+
+    for (i = 0; i < VM_MAXCPUS && n < max; i++) {
+        ring = vmtrace_rings[i];
+        if (ring == NULL) {
+            continue;
+        }
+        head = ring->vr_head;
+        seq = head > VMTRACE_NEVENTS ? head - VMTRACE_NEVENTS : 0;
+        if (skip >= head - seq) {
+            skip -= head - seq;
+            continue;
+        }
+        seq += skip;
+        skip = 0;
+        for (; seq < head && n < max; seq++) {
+            buf[n++] = ring->vr_events[seq % VMTRACE_NEVENTS];
+        }
+    }
+    return n;
+}
+
+/*
+ * vmtrace system call.
+ * VMTRACE_ON and VMTRACE_OFF start and stop recording, VMTRACE_READ copies
+ * up to nevents events to the user buffer and returns how many were copied.
+ */
+int
+sys_vmtrace(int op, userptr_t buf, size_t nevents, int *retval)
+{
+    struct vmtrace_event kbuf[16];
+    unsigned n, total = 0;
+    int result;
+
+    switch (op) {
+        case VMTRACE_OFF:
+        case VMTRACE_ON:
+            *retval = 0;
+            return vmtrace_set(op == VMTRACE_ON);
+        case VMTRACE_READ:
+            break;
+        default:
+            return EINVAL;
+    }
+
+    // go through a small buffer on the stack, copyout may fault
+    while (total < nevents) {
+        n = nevents - total;
+        if (n > ARRAYCOUNT(kbuf)) {
+            n = ARRAYCOUNT(kbuf);
+        }
+        n = vmtrace_read(kbuf, n, total);
+        if (n == 0) {
+            break;
+        }
+        result = copyout(kbuf, (userptr_t)((vaddr_t)buf + total * sizeof(struct vmtrace_event)),
+                         n * sizeof(struct vmtrace_event));
+        if (result) {
+            return result;
+        }
+        total += n;
+    }
+    *retval = total;
+    return 0;
+}
+
+/*
+ * Kernel menu command.
+ *    vmtrace on|off  - start or stop recording
+ *    vmtrace dump    - print every event in the rings
+ *    vmtrace         - print a summary per kind of fault
+ */
+int
+vmtrace_menu(int nargs, char **args)
+{
+    static const char *const names[] = { "hit", "alloc", "dirty", "error" };
+    struct vmtrace_event ev;
+    unsigned count[ARRAYCOUNT(names)], nsecs[ARRAYCOUNT(names)];
+    unsigned i, skip;
+    bool dump = false;
+    int result;
+
+    if (nargs == 2 && (!strcmp(args[1], "on") || !strcmp(args[1], "off"))) {
+        result = vmtrace_set(!strcmp(args[1], "on"));
+        if (result) {
+            kprintf("vmtrace: %s\n", strerror(result));
+        }
+        return result;
+    }
+    if (nargs == 2 && !strcmp(args[1], "dump")) {
+        dump = true;
+    }
+    else if (nargs != 1) {
+        kprintf("Usage: vmtrace [on|off|dump]\n");
+        return EINVAL;
+    }
+
+    for (i = 0; i < ARRAYCOUNT(names); i++) {
+        count[i] = nsecs[i] = 0;
+    }
+    for (skip = 0; vmtrace_read(&ev, 1, skip) == 1; skip++) {
+        if (dump) {
+            kprintf("cpu%u #%u %s 0x%08x as 0x%08x: %s %u ns\n",
+                    (unsigned)ev.vte_cpu, ev.vte_seq,
+                    ev.vte_type == VM_FAULT_READ ? "read" :
+                    ev.vte_type == VM_FAULT_WRITE ? "write" : "readonly",
+                    ev.vte_addr, ev.vte_asid,
+                    ev.vte_result < ARRAYCOUNT(names) ? names[ev.vte_result] : "?",
+                    ev.vte_nsecs);
+        }
+        if (ev.vte_result < ARRAYCOUNT(names)) {
+            count[ev.vte_result]++;
+            nsecs[ev.vte_result] += ev.vte_nsecs;
+        }
+    }
+    kprintf("vmtrace is %s, %u events in the buffers\n",
+            vmtrace_enabled ? "on" : "off", skip);
+    for (i = 0; i < ARRAYCOUNT(names); i++) {
+        kprintf("%-6s %8u faults, %8u ns average\n", names[i], count[i],
+                count[i] ? nsecs[i] / count[i] : 0);
+    }
+    return 0;
+}